@@ -1,4 +1,5 @@
 #include <Arduino.h>
+#include <memory>
 #include <WiFi.h>
 #include <AsyncTCP.h>
 #include <ESPAsyncWebServer.h>
@@ -8,6 +9,7 @@
 #include <NTPClient.h>
 #include <WiFiUdp.h>
 #include <ezTime.h>
+#include <esp_heap_caps.h>
 #include "letters.h"
 #include "env.h"
 #include "utils.h"
@@ -18,26 +20,238 @@
 #include "files.h"
 #include "I2C.h"
 #include "morseCode.h"
-
-bool unitUpdateFlag = false;
+#include "unitHealth.h"
+#include "commandQueue.h"
+#include "playlist.h"
+#include "zones.h"
+#include "feed.h"
+#include "displaySettings.h"
+#include "allocationCounter.h"
+#include "serialConsole.h"
+#include "group.h"
+#include "i2cTrace.h"
+#include "unitProtocol.h"
+
+bool calibrationPending = false;
 long previousFlapMillis = 0;
+char feedValue[MAX_NUM_UNITS + 1] = ""; // Last value handed over by the feed task
 
 // Create AsyncWebServer object on port 80
 AsyncWebServer server(80);
 
 int operationMode;
 
+/**
+ * @caller GET /main and POST /main handlers
+ * @purpose Collect the stored display configuration
+ */
+JSONVar getMainValues()
+{
+  JSONVar values;
+  values[PARAM_ALIGNMENT] = getNvsString(PARAM_ALIGNMENT, "left");
+  values[PARAM_RPM] = getNvsInt(PARAM_RPM, 10);
+  values[PARAM_MODE] = getNvsString(PARAM_MODE, "text");
+  values[PARAM_NUM_UNITS] = getNvsInt(PARAM_NUM_UNITS, 1);
+  values[PARAM_UNITS_PER_SEGMENT] = getUnitsPerSegment();
+  values[PARAM_TEXT] = getNvsString(PARAM_TEXT, "");
+  return values;
+}
+
+/**
+ * @caller applyLoopCommands() and pollSerialConsole() in serialConsole.cpp
+ * @purpose Apply a command on the loop task
+ * @return true if the display has to be rendered again
+ */
+bool applyLoopCommand(const LoopCommand &command)
+{
+  switch (command.type)
+  {
+  case LOOP_COMMAND_SET_TEXT:
+    setDisplayText(command.text);
+    return true;
+  case LOOP_COMMAND_SET_MODE:
+    setDisplayMode(command.text);
+    if (strcmp(command.text, "feed") == 0)
+    {
+      requestFeedFetch();
+    }
+    return true;
+  case LOOP_COMMAND_SET_ALIGNMENT:
+    setDisplayAlignment(command.text);
+    return true;
+  case LOOP_COMMAND_SET_RPM:
+    setDisplayRpm(command.value);
+    return true;
+  case LOOP_COMMAND_SET_NUM_UNITS:
+    setDisplayNumUnits(command.value);
+    return true;
+  case LOOP_COMMAND_SET_UNITS_PER_SEGMENT:
+    setUnitsPerSegment(command.value);
+    return true;
+  case LOOP_COMMAND_SET_TIMEZONE:
+    putNvsString("timezone", command.text);
+    applyUserTimezone();
+    return true;
+  case LOOP_COMMAND_CALIBRATE_POSTED_UNITS:
+    calibrationPending |= stagePostedCalibrations();
+    return false;
+  case LOOP_COMMAND_CALIBRATE_UNIT:
+    stageUnitCalibration(command.unitAddr, command.value, command.value2);
+    calibrationPending = true;
+    return false;
+  case LOOP_COMMAND_RUN_I2C_BENCHMARK:
+    requestI2CBenchmark();
+    return false;
+  case LOOP_COMMAND_SET_ZONES:
+    applyStagedZones();
+    return true;
+  case LOOP_COMMAND_SET_FEED_CONFIG:
+    setFeedConfig(command.value2 & FEED_CONFIG_URL ? command.text : NULL,
+                  command.value2 & FEED_CONFIG_PATH ? command.text + FEED_CONFIG_PATH_OFFSET : NULL,
+                  command.value2 & FEED_CONFIG_INTERVAL ? command.value : 0);
+    return false;
+  case LOOP_COMMAND_SET_FEED_VALUE:
+    strcpy(feedValue, command.text);
+    return strcmp(getDisplaySettings().mode, "feed") == 0;
+  case LOOP_COMMAND_SET_UNIT_PROTOCOL_V2:
+    setUnitProtocolV2Enabled(command.value != 0);
+    return false;
+  case LOOP_COMMAND_SET_GROUP:
+    putNvsInt(PARAM_GROUP_ROLE, command.value);
+    putNvsInt(PARAM_GROUP_TOTAL_UNITS, command.value2);
+    putNvsInt(PARAM_GROUP_UNIT_OFFSET, command.unitAddr);
+    loadGroupConfig();
+    return true;
+  case LOOP_COMMAND_ACTIVATE_PLAYLIST:
+    activatePendingPlaylist();
+    setDisplayMode("playlist");
+    restartPlaylist(0);
+    return true;
+  case LOOP_COMMAND_START_PLAYLIST:
+    setDisplayMode("playlist");
+    restartPlaylist(command.value);
+    return true;
+  }
+  return false;
+}
+
+/**
+ * @caller loop()
+ * @purpose Apply all queued commands in order, then send the staged calibrations
+ * @return true if the display has to be rendered again
+ */
+bool applyLoopCommands()
+{
+  // Static to keep the text buffer off the loop task stack
+  static LoopCommand command;
+  bool renderNeeded = false;
+  while (dequeueLoopCommand(command))
+  {
+    renderNeeded |= applyLoopCommand(command);
+  }
+  if (calibrationPending)
+  {
+    calibrationPending = false;
+    // Make sure that the display is on the home position
+    setDisplayMode("text");
+    setDisplayText(" ");
+    applyPendingUpdates();
+    // Units already showing the blank would otherwise not be sent it again, and so not be homed
+    invalidateFrame();
+    renderNeeded = true;
+  }
+  return renderNeeded;
+}
+
+/**
+ * @caller renderDisplay()
+ * @purpose Show a message on this wall, or on the whole group wall if this one is the coordinator
+ */
+void showModeMessage(const char *message)
+{
+  const DisplaySettings &settings = getDisplaySettings();
+  if (getGroupRole() == GROUP_ROLE_COORDINATOR)
+  {
+    showGroupMessage(message, settings.alignment, settings.rpm);
+  }
+  else
+  {
+    showMessage(message);
+  }
+}
+
+/**
+ * @caller loop()
+ * @purpose Show the content of the current mode
+ */
+void renderDisplay()
+{
+  // Static to keep it off the loop task stack
+  static char dateTime[DATE_TIME_STRING_SIZE];
+  if (getGroupRole() == GROUP_ROLE_MEMBER)
+  {
+    // The coordinator decides what the whole group wall shows, see pollGroup()
+    return;
+  }
+  const DisplaySettings &settings = getDisplaySettings();
+  const char *mode = settings.mode;
+  if (strcmp(mode, "zones") == 0)
+  {
+    renderZones(operationMode == OPERATION_MODE_OFF);
+    return;
+  }
+  // Other modes overwrite the whole frame
+  invalidateZones();
+  if (strcmp(mode, "text") == 0)
+  {
+    showModeMessage(settings.text);
+  }
+  if (strcmp(mode, "date") == 0)
+  {
+    getDateString(dateTime, sizeof(dateTime));
+    showModeMessage(dateTime);
+  }
+  if (strcmp(mode, "clock") == 0)
+  {
+    if (operationMode == OPERATION_MODE_OFF)
+    {
+      showOfflineClock();
+    }
+    else
+    {
+      getClockString(dateTime, sizeof(dateTime));
+      showModeMessage(dateTime);
+    }
+  }
+  if (strcmp(mode, "playlist") == 0)
+  {
+    showPlaylist();
+  }
+  if (strcmp(mode, "feed") == 0)
+  {
+    showModeMessage(feedValue);
+  }
+  if (strcmp(mode, "stream") == 0)
+  {
+    // The frame is composed by the serial console. Keep retrying the units that missed it.
+    dispatchFrame();
+  }
+}
+
 void setup()
 {
   // Serial port for debugging purposes
+  Serial.setRxBufferSize(SERIAL_RX_BUFFER_SIZE); // Before begin(), which allocates the buffer
   Serial.begin(115200);
   Serial.println("===== AfterAI Flaps ESP 1.2.0 =====");
-  Wire.begin(SDA_PIN, SCL_PIN); // SDA, SCL pins
+  beginI2C(); // SDA, SCL pins at the persisted clock
   pinMode(MODE_PIN, INPUT);     // Boot pin. While running, it is used as a toggle button for operation mode change. Externally pulled up.
   pinMode(LED_PIN, OUTPUT);     // Indicator LED pin
   // LED_PIN=HIGH means start of setup
   digitalWrite(LED_PIN, HIGH);
 
+  loadDisplaySettings();
+
   operationMode = initWiFi(OPERATION_MODE_STA); // initializes WiFi
   flashMorseCode(String(operationMode));
   initFS(); // initializes filesystem
@@ -67,20 +281,7 @@ void setup()
 
   server.on("/main", HTTP_GET, [](AsyncWebServerRequest *request)
             {
-    JSONVar values;
-
-    String alignment = getNvsString(PARAM_ALIGNMENT, "left");
-    int rpm = getNvsInt(PARAM_RPM, 10);
-    String mode = getNvsString(PARAM_MODE, "text");
-    int numUnits = getNvsInt(PARAM_NUM_UNITS, 1);
-    String text = getNvsString(PARAM_TEXT, "");
-
-    values[PARAM_ALIGNMENT] = alignment;
-    values[PARAM_RPM] = rpm;
-    values[PARAM_MODE] = mode;
-    values[PARAM_NUM_UNITS] = numUnits;
-    values[PARAM_TEXT] = text;
-
+    JSONVar values = getMainValues();
     String jsonString = JSON.stringify(values);
     request->send(200, "application/json", jsonString); });
 
@@ -101,67 +302,92 @@ void setup()
   // Print the stringified JSON object
   Serial.println(jsonInputString);
 
+  // Validate every field before enqueueing any of them, so that a rejected request changes nothing
+  if (jsonObj.hasOwnProperty("rpm") && JSON.typeof(jsonObj["rpm"]) != "number") {
+      Serial.println("rpm is not a valid number.");
+      request->send(400, "application/json", "{\"error\":\"rpm must be a number\"}");
+      return;
+  }
+
+  if (jsonObj.hasOwnProperty(PARAM_NUM_UNITS)) {
+      JSONVar numUnits = jsonObj[PARAM_NUM_UNITS];
+      if (JSON.typeof(numUnits) != "number" || (int)numUnits < 0 || (int)numUnits > MAX_NUM_UNITS) {
+          Serial.println("numUnits is not a valid number.");
+          request->send(400, "application/json", "{\"error\":\"numUnits must be a number between 0 and 512\"}");
+          return;
+      }
+  }
+
+  if (jsonObj.hasOwnProperty(PARAM_UNITS_PER_SEGMENT)) {
+      JSONVar unitsPerSegment = jsonObj[PARAM_UNITS_PER_SEGMENT];
+      if (JSON.typeof(unitsPerSegment) != "number" || (int)unitsPerSegment < 0 || (int)unitsPerSegment > MAX_UNITS_PER_SEGMENT) {
+          Serial.println("unitsPerSegment is not a valid number.");
+          request->send(400, "application/json", "{\"error\":\"unitsPerSegment must be a number between 0 and 112\"}");
+          return;
+      }
+  }
+
+  const char *fields[] = {PARAM_ALIGNMENT, "rpm", "mode", PARAM_NUM_UNITS, PARAM_UNITS_PER_SEGMENT, "text"};
+  int numCommands = 0;
+  for (const char *field : fields) {
+      if (jsonObj.hasOwnProperty(field)) {
+          numCommands++;
+      }
+  }
+  // This handler is the only producer, so the reserved slots stay free until the commands are enqueued
+  if (!reserveLoopCommands(numCommands)) {
+      request->send(503, "application/json", "{\"error\":\"Busy, try again\"}");
+      return;
+  }
+
+  // The changes are applied by loop(). Respond with the stored values overlaid with the accepted changes.
+  JSONVar values = getMainValues();
+
   if (jsonObj.hasOwnProperty(PARAM_ALIGNMENT)) {
-      putNvsString(PARAM_ALIGNMENT, (const char*) jsonObj[PARAM_ALIGNMENT]);
+      enqueueLoopCommand(makeTextCommand(LOOP_COMMAND_SET_ALIGNMENT, (const char*) jsonObj[PARAM_ALIGNMENT]));
+      values[PARAM_ALIGNMENT] = (const char*) jsonObj[PARAM_ALIGNMENT];
       Serial.print("Alignment set to: ");
-      String alignment = getNvsString(PARAM_ALIGNMENT);
-      Serial.println(alignment);
+      Serial.println((const char*) jsonObj[PARAM_ALIGNMENT]);
   }
 
   if (jsonObj.hasOwnProperty("rpm")) {
       JSONVar rpm = jsonObj["rpm"];
-      if (JSON.typeof(rpm) == "number") {
-          // Process the rpm value
-          Serial.print("rpm set to: ");
-          Serial.println(rpm);
-          putNvsInt("rpm", rpm);
-      } else {
-          Serial.println("rpm is not a valid number.");
-          request->send(400, "application/json", "{\"error\":\"rpm must be a number\"}");
-          return;
-      }
+      Serial.print("rpm set to: ");
+      Serial.println(rpm);
+      enqueueLoopCommand(makeIntCommand(LOOP_COMMAND_SET_RPM, rpm));
+      values[PARAM_RPM] = (int)rpm;
   }
 
   if (jsonObj.hasOwnProperty("mode")) {
-      putNvsString("mode", (const char*) jsonObj["mode"]);
+      enqueueLoopCommand(makeTextCommand(LOOP_COMMAND_SET_MODE, (const char*) jsonObj["mode"]));
+      values[PARAM_MODE] = (const char*) jsonObj["mode"];
       Serial.print("Mode set to: ");
-      Serial.println(getNvsString("mode"));
+      Serial.println((const char*) jsonObj["mode"]);
   }
 
   if (jsonObj.hasOwnProperty(PARAM_NUM_UNITS)) {
       JSONVar numUnits = jsonObj[PARAM_NUM_UNITS];
-      if (JSON.typeof(numUnits) == "number") {
-          // Process the numUnits value
-          Serial.print("numUnits set to: ");
-          Serial.println(numUnits);
-          putNvsInt(PARAM_NUM_UNITS, numUnits);
-      } else {
-          Serial.println("numUnits is not a valid number.");
-          request->send(400, "application/json", "{\"error\":\"numUnits must be a number\"}");
-          return;
-      }
+      Serial.print("numUnits set to: ");
+      Serial.println(numUnits);
+      enqueueLoopCommand(makeIntCommand(LOOP_COMMAND_SET_NUM_UNITS, numUnits));
+      values[PARAM_NUM_UNITS] = (int)numUnits;
+  }
+
+  if (jsonObj.hasOwnProperty(PARAM_UNITS_PER_SEGMENT)) {
+      JSONVar unitsPerSegment = jsonObj[PARAM_UNITS_PER_SEGMENT];
+      Serial.print("unitsPerSegment set to: ");
+      Serial.println(unitsPerSegment);
+      enqueueLoopCommand(makeIntCommand(LOOP_COMMAND_SET_UNITS_PER_SEGMENT, unitsPerSegment));
+      values[PARAM_UNITS_PER_SEGMENT] = (int)unitsPerSegment;
   }
 
   if (jsonObj.hasOwnProperty("text")) {
-      putNvsString("text", (const char*) jsonObj["text"]);
+      enqueueLoopCommand(makeTextCommand(LOOP_COMMAND_SET_TEXT, (const char*) jsonObj["text"]));
+      values[PARAM_TEXT] = (const char*) jsonObj["text"];
       Serial.print("Input 1 set to: ");
-      Serial.println(getNvsString("text"));
+      Serial.println((const char*) jsonObj["text"]);
   }
 
-  JSONVar values;
-
-  String alignment = getNvsString(PARAM_ALIGNMENT, "left");
-  int rpm = getNvsInt(PARAM_RPM, 10);
-  String mode = getNvsString(PARAM_MODE, "text");
-  int numUnits = getNvsInt(PARAM_NUM_UNITS, 1);
-  String text = getNvsString(PARAM_TEXT, "");
-
-  values[PARAM_ALIGNMENT] = alignment;
-  values[PARAM_RPM] = rpm;
-  values[PARAM_MODE] = mode;
-  values[PARAM_NUM_UNITS] = numUnits;
-  values[PARAM_TEXT] = text;
-
   String jsonOutputString = JSON.stringify(values);
   request->send(200, "application/json", jsonOutputString); });
 
@@ -175,6 +401,14 @@ void setup()
       j["subnet"] = getNvsString("subnet");
       j["gateway"] = getNvsString("gateway");
       j["dns"] = getNvsString("dns");
+      WiFiLinkStatus link = getWiFiLinkStatus();
+      j["connected"] = link.connected;
+      j["numDisconnects"] = link.numDisconnects;
+      j["numReconnects"] = link.numReconnects;
+      j["numReconnectAttempts"] = link.numReconnectAttempts;
+      j["lastReconnectMillis"] = link.lastReconnectMillis;
+      j["maxReconnectMillis"] = link.maxReconnectMillis;
+      j["lastDisconnectReason"] = link.lastDisconnectReason;
       String json = JSON.stringify(j);
       request->send(200, "application/json", json); });
 
@@ -243,6 +477,8 @@ void setup()
       j[PARAM_NUM_I2C_BUS_STUCK] = getNumI2CBusStuck();
       unsigned long maxUnsignedLong = 0xFFFFFFFF;
       j["lastI2CBusStuckAgoInMillis"] = getLastI2CBusStuckAtMillis() == 0 ? 0 : (millis() - getLastI2CBusStuckAtMillis()) % maxUnsignedLong;
+      j[PARAM_NUM_OFFLINE_UNITS] = getNumOfflineUnits(getNvsInt(PARAM_NUM_UNITS, 1));
+      j[PARAM_UNIT_PROTOCOL_V2] = getNvsInt(PARAM_UNIT_PROTOCOL_V2, 0) != 0;
       String json = JSON.stringify(j);
       request->send(200, "application/json", json); });
 
@@ -257,21 +493,367 @@ void setup()
             return;
         }
 
+        bool hasUnitProtocolV2 = jsonObj.hasOwnProperty(PARAM_UNIT_PROTOCOL_V2);
+        if (hasUnitProtocolV2 && JSON.typeof(jsonObj[PARAM_UNIT_PROTOCOL_V2]) != "boolean") {
+            request->send(400, "application/json", "{\"error\":\"unitProtocolV2 must be a boolean\"}");
+            return;
+        }
+        if (!reserveLoopCommands(jsonObj.hasOwnProperty("timezone") + hasUnitProtocolV2)) {
+            request->send(503, "application/json", "{\"error\":\"Busy, try again\"}");
+            return;
+        }
+
+        JSONVar j;
+        j["timezone"] = getNvsString("timezone");
+        j[PARAM_UNIT_PROTOCOL_V2] = getNvsInt(PARAM_UNIT_PROTOCOL_V2, 0) != 0;
+
         if (jsonObj.hasOwnProperty("timezone")) {
             Serial.print("Setting timezone: ");
             Serial.println((const char*) jsonObj["timezone"]);
-            putNvsString("timezone", (const char*) jsonObj["timezone"]);
-            applyUserTimezone();
+            enqueueLoopCommand(makeTextCommand(LOOP_COMMAND_SET_TIMEZONE, (const char*) jsonObj["timezone"]));
+            j["timezone"] = (const char*) jsonObj["timezone"];
+        }
+
+        if (hasUnitProtocolV2) {
+            bool enabled = (bool)jsonObj[PARAM_UNIT_PROTOCOL_V2];
+            enqueueLoopCommand(makeIntCommand(LOOP_COMMAND_SET_UNIT_PROTOCOL_V2, enabled));
+            j[PARAM_UNIT_PROTOCOL_V2] = enabled;
         }
 
-        JSONVar j;
-        j["timezone"] = getNvsString("timezone");
         String jsonResponse = JSON.stringify(j);
         request->send(200, "application/json", jsonResponse); });
 
+  // Registered before /i2c, which would otherwise match them as a prefix
+  server.on("/i2c/trace.csv", HTTP_GET, [](AsyncWebServerRequest *request)
+            {
+    std::shared_ptr<I2CTraceCursor> cursor = std::make_shared<I2CTraceCursor>();
+    cursor->format = I2C_TRACE_FORMAT_CSV;
+    AsyncWebServerResponse* response = request->beginChunkedResponse("text/csv",
+                                      [cursor](uint8_t* buffer, size_t maxLen, size_t index)
+    {
+      return serializeI2CTraceChunk(*cursor, buffer, maxLen);
+    });
+    request -> send(response); });
+
+  server.on("/i2c/trace.vcd", HTTP_GET, [](AsyncWebServerRequest *request)
+            {
+    std::shared_ptr<I2CTraceCursor> cursor = std::make_shared<I2CTraceCursor>();
+    cursor->format = I2C_TRACE_FORMAT_VCD;
+    AsyncWebServerResponse* response = request->beginChunkedResponse("text/plain",
+                                      [cursor](uint8_t* buffer, size_t maxLen, size_t index)
+    {
+      return serializeI2CTraceChunk(*cursor, buffer, maxLen);
+    });
+    request -> send(response); });
+
+  server.on("/i2c/trace", HTTP_GET, [](AsyncWebServerRequest *request)
+            {
+      I2CTraceStatus status = getI2CTraceStatus();
+      JSONVar j;
+      j["state"] = getI2CTraceStateName(status.state);
+      j["trigger"] = getI2CTraceTriggerName(status.trigger);
+      j["unitAddr"] = status.triggerUnitAddr;
+      j["postTriggerRecords"] = status.postTriggerRecords;
+      j["numRecords"] = status.numRecords;
+      j["armedAtMillis"] = status.armedAtMillis;
+      j["triggeredAtMillis"] = status.triggeredAtMillis;
+      String json = JSON.stringify(j);
+      request->send(200, "application/json", json); });
+
+  server.on("/i2c/trace", HTTP_POST, [](AsyncWebServerRequest *request) {}, NULL, [](AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total)
+            {
+      String jsonString = String((char*)data).substring(0, len);
+      JSONVar jsonObj = JSON.parse(jsonString);
+
+      if (JSON.typeof(jsonObj) == "undefined" || !jsonObj.hasOwnProperty("trigger")) {
+          request->send(400, "application/json", "{\"error\":\"trigger is required\"}");
+          return;
+      }
+
+      String triggerName = (const char*) jsonObj["trigger"];
+      if (triggerName == "off") {
+          disarmI2CTrace();
+      } else {
+          int trigger = parseI2CTraceTrigger(triggerName.c_str());
+          if (trigger < 0) {
+              request->send(400, "application/json", "{\"error\":\"trigger must be off, immediate, error or unit\"}");
+              return;
+          }
+          int unitAddr = 0;
+          if (trigger == I2C_TRACE_TRIGGER_UNIT) {
+              JSONVar value = jsonObj["unitAddr"];
+              if (JSON.typeof(value) != "number" || (int)value < 0 || (int)value >= MAX_NUM_UNITS) {
+                  request->send(400, "application/json", "{\"error\":\"unitAddr must be a unit address\"}");
+                  return;
+              }
+              unitAddr = (int)value;
+          }
+          int postTriggerRecords = I2C_TRACE_SIZE / 2;
+          if (jsonObj.hasOwnProperty("postTriggerRecords")) {
+              JSONVar value = jsonObj["postTriggerRecords"];
+              if (JSON.typeof(value) != "number" || (int)value < 0 || (int)value >= I2C_TRACE_SIZE) {
+                  request->send(400, "application/json", "{\"error\":\"postTriggerRecords must be a number between 0 and 511\"}");
+                  return;
+              }
+              postTriggerRecords = (int)value;
+          }
+          armI2CTrace(trigger, unitAddr, postTriggerRecords);
+      }
+
+      I2CTraceStatus status = getI2CTraceStatus();
+      JSONVar j;
+      j["state"] = getI2CTraceStateName(status.state);
+      j["trigger"] = getI2CTraceTriggerName(status.trigger);
+      j["unitAddr"] = status.triggerUnitAddr;
+      j["postTriggerRecords"] = status.postTriggerRecords;
+      String json = JSON.stringify(j);
+      request->send(200, "application/json", json); });
+
+  server.on("/i2c", HTTP_GET, [](AsyncWebServerRequest *request)
+            {
+      JSONVar j;
+      j["clock"] = getI2CClock();
+      j["errorRate"] = getI2CErrorRate();
+      j["numClockFallbacks"] = getNumI2CClockFallbacks();
+      j["benchmarkRequested"] = isI2CBenchmarkRequested();
+      j["benchmarkedAtMillis"] = getI2CBenchmarkedAtMillis();
+      int numUnits = getI2CBenchmarkedAtMillis() == 0 ? 0 : getNvsInt(PARAM_NUM_UNITS, 1);
+      if (numUnits <= 0)
+      {
+        j["units"] = JSON.parse("[]");
+      }
+      for (int i = 0; i < numUnits; i++)
+      {
+        j["units"][i]["unitAddr"] = i;
+        for (int c = 0; c < NUM_I2C_CLOCKS; c++)
+        {
+          I2CBenchmarkResult result = getI2CBenchmarkResult(i, c);
+          j["units"][i]["results"][c]["clock"] = (unsigned long)getI2CCandidateClock(c);
+          j["units"][i]["results"][c]["avgLatencyUs"] = result.avgLatencyUs;
+          j["units"][i]["results"][c]["numErrors"] = result.numErrors;
+          j["units"][i]["results"][c]["numRounds"] = result.numRounds;
+        }
+      }
+      String json = JSON.stringify(j);
+      request->send(200, "application/json", json); });
+
+  server.on("/i2c/benchmark", HTTP_POST, [](AsyncWebServerRequest *request)
+            {
+      if (!enqueueLoopCommand(makeIntCommand(LOOP_COMMAND_RUN_I2C_BENCHMARK, 0)))
+      {
+        request->send(503, "application/json", "{\"error\":\"Busy, try again\"}");
+        return;
+      }
+      request->send(202, "application/json", "{\"benchmarkRequested\":true}"); });
+
+  server.on("/heap", HTTP_GET, [](AsyncWebServerRequest *request)
+            {
+      AllocationStats stats = getAllocationStats();
+      multi_heap_info_t info;
+      heap_caps_get_info(&info, MALLOC_CAP_8BIT);
+      JSONVar j;
+      j["allocationCountExact"] = stats.exact;
+      j["numTicks"] = stats.numTicks;
+      j["lastTickAllocations"] = stats.lastTickAllocations;
+      j["maxTickAllocations"] = stats.maxTickAllocations;
+      j["numTicksWithAllocations"] = stats.numTicksWithAllocations;
+      j["freeBytes"] = (unsigned long)info.total_free_bytes;
+      j["minimumFreeBytes"] = (unsigned long)info.minimum_free_bytes;
+      j["largestFreeBlock"] = (unsigned long)info.largest_free_block;
+      j["allocatedBlocks"] = (unsigned long)info.allocated_blocks;
+      String json = JSON.stringify(j);
+      request->send(200, "application/json", json); });
+
+  server.on("/zones", HTTP_GET, [](AsyncWebServerRequest *request)
+            {
+      String json = getNvsString(PARAM_ZONES, "[]");
+      request->send(200, "application/json", json); });
+
+  server.on("/zones", HTTP_POST, [](AsyncWebServerRequest *request) {}, NULL, [](AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total)
+            {
+      static String jsonString;
+
+      // Append current chunk to jsonString
+      if (index == 0)
+      {
+        jsonString = "";
+      }
+      jsonString += String((char*)data).substring(0, len);
+      if (index + len != total)
+      {
+        return;
+      }
+
+      String zonesJson = validateZones(jsonString);
+      jsonString = "";
+      if (zonesJson.length() == 0)
+      {
+        request->send(400, "application/json", "{\"error\":\"Invalid zones\"}");
+        return;
+      }
+      // loop() stores the zones, so that the handler does not block on a flash write. The slot is reserved first, so that a staged list is always applied.
+      if (!reserveLoopCommands(1))
+      {
+        request->send(503, "application/json", "{\"error\":\"Busy, try again\"}");
+        return;
+      }
+      stageZones(zonesJson);
+      enqueueLoopCommand(makeIntCommand(LOOP_COMMAND_SET_ZONES, 0));
+      request->send(200, "application/json", zonesJson); });
+
+  server.on("/feed", HTTP_GET, [](AsyncWebServerRequest *request)
+            {
+      FeedStatus status = getFeedStatus();
+      JSONVar j;
+      j[PARAM_FEED_URL] = getNvsString(PARAM_FEED_URL, "");
+      j[PARAM_FEED_PATH] = getNvsString(PARAM_FEED_PATH, "");
+      j[PARAM_FEED_INTERVAL_SEC] = getNvsInt(PARAM_FEED_INTERVAL_SEC, FEED_DEFAULT_INTERVAL_SEC);
+      j["value"] = status.value;
+      j["lastStatusCode"] = status.lastStatusCode;
+      j["fetchedAtMillis"] = status.fetchedAtMillis;
+      j["numFetches"] = status.numFetches;
+      j["numNotModified"] = status.numNotModified;
+      j["numErrors"] = status.numErrors;
+      String json = JSON.stringify(j);
+      request->send(200, "application/json", json); });
+
+  server.on("/feed", HTTP_POST, [](AsyncWebServerRequest *request) {}, NULL, [](AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total)
+            {
+      String jsonString = String((char*)data).substring(0, len);
+      JSONVar jsonObj = JSON.parse(jsonString);
+
+      if (JSON.typeof(jsonObj) == "undefined") {
+          Serial.println("Parsing input failed!");
+          request->send(400, "application/json", "{\"error\":\"Invalid JSON\"}");
+          return;
+      }
+
+      // Validate everything before storing anything
+      if (jsonObj.hasOwnProperty(PARAM_FEED_URL)) {
+          String url = (const char*) jsonObj[PARAM_FEED_URL];
+          bool isHttp = url.startsWith("http://") || url.startsWith("https://");
+          if (url.length() > FEED_URL_MAX_LENGTH || (url.length() > 0 && !isHttp)) {
+              request->send(400, "application/json", "{\"error\":\"feedUrl must be an http(s) URL\"}");
+              return;
+          }
+      }
+      if (jsonObj.hasOwnProperty(PARAM_FEED_PATH) && !isValidFeedPath((const char*) jsonObj[PARAM_FEED_PATH])) {
+          request->send(400, "application/json", "{\"error\":\"Invalid feedPath\"}");
+          return;
+      }
+      if (jsonObj.hasOwnProperty(PARAM_FEED_INTERVAL_SEC)) {
+          JSONVar intervalSec = jsonObj[PARAM_FEED_INTERVAL_SEC];
+          if (JSON.typeof(intervalSec) != "number" || (int)intervalSec < FEED_MIN_INTERVAL_SEC || (int)intervalSec > FEED_MAX_INTERVAL_SEC) {
+              request->send(400, "application/json", "{\"error\":\"feedIntervalSec must be a number between 5 and 86400\"}");
+              return;
+          }
+      }
+
+      // loop() stores the settings and hands them to the feed task in one piece. Respond with the stored values overlaid with the accepted changes.
+      JSONVar j;
+      j[PARAM_FEED_URL] = getNvsString(PARAM_FEED_URL, "");
+      j[PARAM_FEED_PATH] = getNvsString(PARAM_FEED_PATH, "");
+      j[PARAM_FEED_INTERVAL_SEC] = getNvsInt(PARAM_FEED_INTERVAL_SEC, FEED_DEFAULT_INTERVAL_SEC);
+      const char *url = NULL;
+      const char *path = NULL;
+      int intervalSec = 0;
+      if (jsonObj.hasOwnProperty(PARAM_FEED_URL)) {
+          url = (const char*) jsonObj[PARAM_FEED_URL];
+          j[PARAM_FEED_URL] = url;
+      }
+      if (jsonObj.hasOwnProperty(PARAM_FEED_PATH)) {
+          path = (const char*) jsonObj[PARAM_FEED_PATH];
+          j[PARAM_FEED_PATH] = path;
+      }
+      if (jsonObj.hasOwnProperty(PARAM_FEED_INTERVAL_SEC)) {
+          intervalSec = (int)jsonObj[PARAM_FEED_INTERVAL_SEC];
+          j[PARAM_FEED_INTERVAL_SEC] = intervalSec;
+      }
+      if (!enqueueLoopCommand(makeFeedConfigCommand(url, path, intervalSec))) {
+          request->send(503, "application/json", "{\"error\":\"Busy, try again\"}");
+          return;
+      }
+
+      String json = JSON.stringify(j);
+      request->send(200, "application/json", json); });
+
+  server.on("/group", HTTP_GET, [](AsyncWebServerRequest *request)
+            {
+      GroupStatus status = getGroupStatus();
+      JSONVar j;
+      j[PARAM_GROUP_ROLE] = getGroupRoleName(status.role);
+      j[PARAM_GROUP_TOTAL_UNITS] = status.totalUnits;
+      j[PARAM_GROUP_UNIT_OFFSET] = status.unitOffset;
+      j["clockOffsetMillis"] = (int)status.clockOffsetMillis;
+      j["numPacketsSent"] = status.numPacketsSent;
+      j["numPacketsReceived"] = status.numPacketsReceived;
+      j["numFramesPresented"] = status.numFramesPresented;
+      j["numLateFrames"] = status.numLateFrames;
+      j["lastSequence"] = status.lastSequence;
+      String json = JSON.stringify(j);
+      request->send(200, "application/json", json); });
+
+  server.on("/group", HTTP_POST, [](AsyncWebServerRequest *request) {}, NULL, [](AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total)
+            {
+      String jsonString = String((char*)data).substring(0, len);
+      JSONVar jsonObj = JSON.parse(jsonString);
+
+      if (JSON.typeof(jsonObj) == "undefined") {
+          Serial.println("Parsing input failed!");
+          request->send(400, "application/json", "{\"error\":\"Invalid JSON\"}");
+          return;
+      }
+
+      // Validate everything before storing anything
+      int role = getNvsInt(PARAM_GROUP_ROLE, GROUP_ROLE_OFF);
+      int totalUnits = getNvsInt(PARAM_GROUP_TOTAL_UNITS, 0);
+      int unitOffset = getNvsInt(PARAM_GROUP_UNIT_OFFSET, 0);
+      if (jsonObj.hasOwnProperty(PARAM_GROUP_ROLE)) {
+          role = parseGroupRole((const char*) jsonObj[PARAM_GROUP_ROLE]);
+          if (role < 0) {
+              request->send(400, "application/json", "{\"error\":\"groupRole must be off, coordinator or member\"}");
+              return;
+          }
+      }
+      if (jsonObj.hasOwnProperty(PARAM_GROUP_TOTAL_UNITS)) {
+          JSONVar value = jsonObj[PARAM_GROUP_TOTAL_UNITS];
+          if (JSON.typeof(value) != "number" || (int)value < 1 || (int)value > GROUP_MAX_TOTAL_UNITS) {
+              request->send(400, "application/json", "{\"error\":\"groupTotalUnits must be a number between 1 and 4096\"}");
+              return;
+          }
+          totalUnits = (int)value;
+      }
+      if (jsonObj.hasOwnProperty(PARAM_GROUP_UNIT_OFFSET)) {
+          JSONVar value = jsonObj[PARAM_GROUP_UNIT_OFFSET];
+          if (JSON.typeof(value) != "number" || (int)value < 0) {
+              request->send(400, "application/json", "{\"error\":\"groupUnitOffset must be a non-negative number\"}");
+              return;
+          }
+          unitOffset = (int)value;
+      }
+      if (role != GROUP_ROLE_OFF && unitOffset + getDisplaySettings().numUnits > totalUnits) {
+          request->send(400, "application/json", "{\"error\":\"The units of this wall must be within groupTotalUnits\"}");
+          return;
+      }
+
+      // loop() stores the settings, so that the handler does not block on a flash write
+      if (!enqueueLoopCommand(makeGroupCommand(role, totalUnits, unitOffset)))
+      {
+        request->send(503, "application/json", "{\"error\":\"Busy, try again\"}");
+        return;
+      }
+
+      JSONVar j;
+      j[PARAM_GROUP_ROLE] = getGroupRoleName(role);
+      j[PARAM_GROUP_TOTAL_UNITS] = totalUnits;
+      j[PARAM_GROUP_UNIT_OFFSET] = unitOffset;
+      String json = JSON.stringify(j);
+      request->send(200, "application/json", json); });
+
   server.on("/clock", HTTP_GET, [](AsyncWebServerRequest *request)
             {
-      String clock = getClockString();
+      char clock[DATE_TIME_STRING_SIZE];
+      getClockString(clock, sizeof(clock));
       JSONVar j;
       j["clock"] = clock;
       String json = JSON.stringify(j);
@@ -306,17 +888,14 @@ void setup()
         // Clear jsonString for future requests
         jsonString = "";
 
-        // Main processing
-        UnitState *pendingUpdates = getPendingUpdates();
-
-        if (JSON.typeof(jsonObj) == "undefined") {
-            Serial.println("Parsing input failed!");
-            request->send(400, "application/json", "{\"error\":\"Invalid JSON\"}");
-            return;
+        // Main processing. The whole batch is handed over to loop() with a single command, which stages and sends it.
+        // Its slot is reserved first, so that a posted calibration is always applied, and never twice when a client retries after a 503.
+        if (!reserveLoopCommands(1)) {
+          request->send(503, "application/json", "{\"error\":\"Busy, try again\"}");
+          return;
         }
 
-        Serial.printf("Unit update request jsonString: %s\n", jsonString.c_str());
-
+        int numPosted = 0;
         for(int i = 0; i < jsonObj.length(); i++) {
           JSONVar unit = jsonObj[i];
           int unitAddr = -1;
@@ -335,10 +914,9 @@ void setup()
               magneticZeroPositionLetterIndex = (int)unit[PARAM_MAGNETIC_ZERO_POSITION_LETTER_INDEX];
           }
 
-          if (unitAddr != -1 && offset != -1 && magneticZeroPositionLetterIndex != -1) {
-              pendingUpdates[unitAddr].unitAddr = unitAddr;
-              pendingUpdates[unitAddr].offset = offset;
-              pendingUpdates[unitAddr].magneticZeroPositionLetterIndex = magneticZeroPositionLetterIndex;
+          if (0 <= unitAddr && unitAddr < MAX_NUM_UNITS && offset != -1 && magneticZeroPositionLetterIndex != -1) {
+              postUnitCalibration(unitAddr, offset, magneticZeroPositionLetterIndex);
+              numPosted++;
           } else {
               Serial.println("Invalid unit address, offset or magneticZeroPositionLetterIndex");
               Serial.print("Unit address: ");
@@ -349,27 +927,15 @@ void setup()
               Serial.println(magneticZeroPositionLetterIndex);
           }
         }
-        unitUpdateFlag = true;
-        setPendingUpdates(pendingUpdates);
+        if (numPosted > 0) {
+          enqueueLoopCommand(makeIntCommand(LOOP_COMMAND_CALIBRATE_POSTED_UNITS, 0));
+        }
 
+        std::shared_ptr<UnitStatesCursor> cursor = std::make_shared<UnitStatesCursor>();
         AsyncWebServerResponse* response = request->beginChunkedResponse("application/json",
-                                          [](uint8_t* buffer, size_t maxLen, size_t index)
+                                          [cursor](uint8_t* buffer, size_t maxLen, size_t index)
         {
-          String jsonStringCache = getPendingUpdatesSerialized();
-          const char* jsonCChar = jsonStringCache.c_str();
-          if (strlen(jsonCChar) <= index)
-          {
-            return 0;
-          }
-          if (jsonCChar == NULL)
-          {
-            return 0;
-          }
-          // Copy the next chunk of the data (json) to the buffer. Return the length copied.
-          size_t remainingLen = strlen(jsonCChar + index);
-          int toCopy = maxLen > remainingLen ? remainingLen : maxLen;
-          memcpy(buffer, jsonCChar + index, toCopy);
-          return toCopy;
+          return serializeUnitStatesChunk(*cursor, buffer, maxLen);
         });
         request -> send(response);
       } });
@@ -377,30 +943,81 @@ void setup()
   server.on("/unit", HTTP_GET, [](AsyncWebServerRequest *request)
             {
     // Return all the unit states in JSON format
-    // Responding with chunks is necessary to send large data with AsyncWebServer
-    // However, this impelmentation is not working as expected for MAX_NUM_UNITS=256
-    // TODO: Fix this implementation
+    // Responding with chunks is necessary to send large data with AsyncWebServer. The JSON is rendered unit by unit as the chunks are requested.
+    std::shared_ptr<UnitStatesCursor> cursor = std::make_shared<UnitStatesCursor>();
     AsyncWebServerResponse* response = request->beginChunkedResponse("application/json",
-                                      [](uint8_t* buffer, size_t maxLen, size_t index)
+                                      [cursor](uint8_t* buffer, size_t maxLen, size_t index)
     {
-      String jsonStringCache = getPendingUpdatesSerialized();
-      const char* jsonCChar = jsonStringCache.c_str();
-      if (strlen(jsonCChar) <= index)
-      {
-        return 0;
+      return serializeUnitStatesChunk(*cursor, buffer, maxLen);
+    });
+    request -> send(response); });
+
+  // Registered before /playlist, which would otherwise match /playlist/activate as a prefix
+  server.on("/playlist/activate", HTTP_POST, [](AsyncWebServerRequest *request) {}, NULL, [](AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total)
+            {
+      String jsonString = String((char*)data).substring(0, len);
+      JSONVar jsonObj = JSON.parse(jsonString);
+
+      int entryIndex = 0;
+      if (JSON.typeof(jsonObj) == "object" && jsonObj.hasOwnProperty("entry")) {
+          if (JSON.typeof(jsonObj["entry"]) != "number") {
+              request->send(400, "application/json", "{\"error\":\"entry must be a number\"}");
+              return;
+          }
+          entryIndex = (int)jsonObj["entry"];
       }
-      if (jsonCChar == NULL)
-      {
-        return 0;
+
+      if (!enqueueLoopCommand(makeIntCommand(LOOP_COMMAND_START_PLAYLIST, entryIndex))) {
+          request->send(503, "application/json", "{\"error\":\"Busy, try again\"}");
+          return;
       }
-      // Copy the next chunk of the data (json) to the buffer. Return the length copied.
-      size_t remainingLen = strlen(jsonCChar + index);
-      int toCopy = maxLen > remainingLen ? remainingLen : maxLen;
-      memcpy(buffer, jsonCChar + index, toCopy);
-      return toCopy;
+      JSONVar j;
+      j[PARAM_MODE] = "playlist";
+      j["entry"] = entryIndex;
+      String json = JSON.stringify(j);
+      request->send(200, "application/json", json); });
+
+  server.on("/playlist", HTTP_GET, [](AsyncWebServerRequest *request)
+            {
+    // The listing is read from the file one entry at a time as the chunks are requested
+    std::shared_ptr<PlaylistCursor> cursor = std::make_shared<PlaylistCursor>();
+    AsyncWebServerResponse* response = request->beginChunkedResponse("application/json",
+                                      [cursor](uint8_t* buffer, size_t maxLen, size_t index)
+    {
+      return serializePlaylistChunk(*cursor, buffer, maxLen);
     });
     request -> send(response); });
 
+  server.on("/playlist", HTTP_POST, [](AsyncWebServerRequest *request) {}, NULL, [](AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total)
+            {
+      // The body is the binary playlist file, written to flash chunk by chunk
+      if (index == 0)
+      {
+        beginPlaylistUpload(total);
+      }
+      writePlaylistUploadChunk(data, len);
+      if (index + len != total)
+      {
+        return;
+      }
+
+      int numEntries = finishPlaylistUpload();
+      if (numEntries < 0)
+      {
+        request->send(400, "application/json", "{\"error\":\"Invalid playlist\"}");
+        return;
+      }
+      // loop() swaps the file in and starts over, since the entries of the old file are gone
+      if (!enqueueLoopCommand(makeIntCommand(LOOP_COMMAND_ACTIVATE_PLAYLIST, 0)))
+      {
+        request->send(503, "application/json", "{\"error\":\"Busy, try again\"}");
+        return;
+      }
+      JSONVar j;
+      j["numEntries"] = numEntries;
+      String json = JSON.stringify(j);
+      request->send(200, "application/json", json); });
+
   server.on("/restart", HTTP_POST, [](AsyncWebServerRequest *request) {}, NULL, [](AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total)
             {
       Serial.println("Restarting...");
@@ -408,6 +1025,15 @@ void setup()
       delay(1000);
       ESP.restart(); });
 
+  // setup() and loop() run on the same task. Web API handlers wake it up with commands.
+  setLoopTaskHandle(xTaskGetCurrentTaskHandle());
+
+  initFrame();
+  loadZones();
+  startFeedTask();
+  loadGroupConfig();
+  loadUnitProtocolSetting();
+
   Serial.println("HTTP server starting");
   server.begin();
   Serial.println("HTTP server started");
@@ -415,7 +1041,7 @@ void setup()
   if (operationMode == OPERATION_MODE_STA)
   {
     // Display the current IP address
-    showMessage(WiFi.localIP().toString());
+    showMessage(WiFi.localIP().toString().c_str());
     // Delay for the user to check the IP address on display
     delay(5000);
   }
@@ -452,8 +1078,17 @@ void loop()
     }
   }
 
+  bool renderNeeded = applyLoopCommands();
+  renderNeeded |= pollSerialConsole(applyLoopCommand);
+  if (superviseWiFi(operationMode))
+  {
+    // Multicast memberships do not survive a dropped link
+    loadGroupConfig();
+  }
+  pollGroup();
+
   // Delay to not spam web requests
-  if (currentMillis - previousFlapMillis >= 1000)
+  if (currentMillis - previousFlapMillis >= LOOP_TICK_MILLIS)
   {
     previousFlapMillis = currentMillis;
 
@@ -469,62 +1104,59 @@ void loop()
       events(); // ezTime library function.
     }
 
-    if (unitUpdateFlag)
+    if (isI2CBenchmarkRequested())
     {
-      unitUpdateFlag = false;
-      // Make sure that the display is on the home position
-      putNvsString("mode", "text");
-      putNvsString("text", " ");
-      applyPendingUpdates();
+      runI2CBenchmark(getDisplaySettings().numUnits);
     }
 
+    // Polling, rendering and logging must not allocate on the heap, which would fragment it over days of uptime
+    beginAllocationCount();
+
     fetchAndSetUnitStates();
 
     // Mode Selection
-    String mode = getNvsString("mode");
-    String alignment = getNvsString(PARAM_ALIGNMENT);
-    int rpm = getNvsInt("rpm");
+    const DisplaySettings &settings = getDisplaySettings();
     switch (operationMode)
     {
     case OPERATION_MODE_STA:
     {
       IPAddress i = WiFi.localIP();
-      Serial.printf("Operation mode: STA, IP Address: %s, mode: %s, alignment: %s, rpm: %d\n",
-                    i.toString().c_str(),
-                    mode.c_str(),
-                    alignment.c_str(),
-                    rpm);
+      logF("Operation mode: STA, IP Address: %u.%u.%u.%u, mode: %s, alignment: %s, rpm: %d\n",
+           i[0], i[1], i[2], i[3],
+           settings.mode,
+           settings.alignment,
+           settings.rpm);
       break;
     }
     case OPERATION_MODE_AP:
     {
       IPAddress i = WiFi.softAPIP();
-      Serial.printf("Operation mode: AP, IP Address: %s, mode: %s, alignment: %s, rpm: %d\n",
-                    i.toString().c_str(),
-                    mode.c_str(),
-                    alignment.c_str(),
-                    rpm);
+      logF("Operation mode: AP, IP Address: %u.%u.%u.%u, mode: %s, alignment: %s, rpm: %d\n",
+           i[0], i[1], i[2], i[3],
+           settings.mode,
+           settings.alignment,
+           settings.rpm);
       break;
     }
     case OPERATION_MODE_OFF:
     {
-      Serial.printf("Operation mode: OFF, mode: %s, alignment: %s, rpm: %d\n",
-                    mode.c_str(),
-                    alignment.c_str(),
-                    rpm);
+      logF("Operation mode: OFF, mode: %s, alignment: %s, rpm: %d\n",
+           settings.mode,
+           settings.alignment,
+           settings.rpm);
       break;
     }
     }
     Serial.print("Magnet: ");
     UnitState *unitStates = getFetchedStates();
-    for (int i = 0; i < getNvsInt(PARAM_NUM_UNITS); i++)
+    for (int i = 0; i < settings.numUnits; i++)
     {
       if (i == 0)
       {
         Serial.print("[");
       }
       Serial.print(translateIndextoLetter(unitStates[i].magneticZeroPositionLetterIndex));
-      if (i == getNvsInt(PARAM_NUM_UNITS) - 1)
+      if (i == settings.numUnits - 1)
       {
         Serial.printf("]\n");
       }
@@ -533,129 +1165,27 @@ void loop()
         Serial.print(", ");
       }
     }
-    Serial.printf("Offsets: %s\n", getOffsetsInString().c_str());
-    if (operationMode == OPERATION_MODE_OFF && Serial.available())
-    {                                              // Check if data is available to read
-      String input = Serial.readStringUntil('\n'); // Read input until newline character
-      input.trim();                                // Remove leading and trailing whitespaces
-      Serial.printf("Received: %s\n", input.c_str());
-      // If argumnent is of form mode
-      if (input.startsWith("mode"))
-      {
-        if (input.endsWith("text"))
-        {
-          putNvsString("mode", "text");
-          return;
-        }
-        else if (input.endsWith("date"))
-        {
-          putNvsString("mode", "date");
-          return;
-        }
-        else if (input.endsWith("clock"))
-        {
-          putNvsString("mode", "clock");
-          return;
-        }
-      }
-      if (input.startsWith(PARAM_ALIGNMENT))
-      {
-        if (input.endsWith("left"))
-        {
-          putNvsString(PARAM_ALIGNMENT, "left");
-          return;
-        }
-        else if (input.endsWith("right"))
-        {
-          putNvsString(PARAM_ALIGNMENT, "right");
-          return;
-        }
-        else if (input.endsWith("center"))
-        {
-          putNvsString(PARAM_ALIGNMENT, "center");
-          return;
-        }
-      }
-      if (input.startsWith("rpm"))
-      {
-        int rpm = -1;
-        sscanf(input.c_str(), "rpm %d", &rpm);
-        if (0 < rpm && rpm <= 12)
-        {
-          putNvsInt("rpm", rpm);
-          return;
-        }
-      }
-      // If input is of form set unit_id offset_value, update the offset of the unit
-      // Note that the lengths of unit_id and offset_value are unknown
-      if (input.startsWith("offset"))
-      {
-        int unitAddr = -1;
-        int offset = -1;
-        sscanf(input.c_str(), "offset %d %d", &unitAddr, &offset);
-        if (unitAddr != -1 && offset != -1)
-        {
-          UnitState *unitStates = getFetchedStates();
-          unitStates[unitAddr].offset = offset;
-          unitUpdateFlag = true;
-          setPendingUpdates(unitStates);
-          return;
-        }
-      }
-
-      if (input.startsWith("magnet"))
-      {
-        int unitAddr = -1;
-        char magneticZeroPositionLetter;
-        int sscanfCount = sscanf(input.c_str(), "magnet %d %c", &unitAddr, &magneticZeroPositionLetter);
-        if (sscanfCount == 1)
-        {
-          magneticZeroPositionLetter = ' ';
-        }
-        int magneticZeroPositionLetterIndex = translateLetterToIndex(magneticZeroPositionLetter);
-        Serial.printf("magnet: %c, %d\n", magneticZeroPositionLetter, magneticZeroPositionLetterIndex);
-        if (unitAddr != -1 && magneticZeroPositionLetterIndex != -1)
-        {
-          int suggestedOffset = getSuggestedOffset(magneticZeroPositionLetterIndex);
-          UnitState *unitStates = getFetchedStates();
-          unitStates[unitAddr].magneticZeroPositionLetterIndex = magneticZeroPositionLetterIndex;
-          unitStates[unitAddr].offset = suggestedOffset;
-          unitUpdateFlag = true;
-          setPendingUpdates(unitStates);
-          return;
-        }
-      }
-
-      if (input.startsWith("clock"))
-      {
-        char clock[6];
-        sscanf(input.c_str(), "clock %s", clock);
-        setOfflineClock(clock);
-        return;
-      }
-
-      putNvsString("text", input);
-    }
-
-    if (mode == "text")
+    Serial.print("Offsets: [");
+    for (int i = 0; i < settings.numUnits; i++)
     {
-      showMessage(getNvsString("text"));
-    }
-    if (mode == "date")
-    {
-      showMessage(getDateString());
-    }
-    if (mode == "clock")
-    {
-      if (operationMode == OPERATION_MODE_OFF)
-      {
-        showOfflineClock();
-      }
-      else
+      Serial.print(unitStates[i].offset);
+      if (i < settings.numUnits - 1)
       {
-        showMessage(getClockString());
+        Serial.print(",");
       }
     }
+    Serial.println("]");
+    renderDisplay();
+    endAllocationCount();
     Serial.println();
   }
+  else if (renderNeeded)
+  {
+    // Show a change right away instead of on the next tick
+    renderDisplay();
+  }
+
+  // Sleep until a command arrives, the next tick is due, or the mode button needs a check
+  long untilNextTickMillis = LOOP_TICK_MILLIS - (long)(millis() - previousFlapMillis);
+  waitForLoopCommands(getGroupWaitMillis(constrain(untilNextTickMillis, 0L, (long)LOOP_IDLE_WAIT_MILLIS)));
 }
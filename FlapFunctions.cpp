@@ -1,11 +1,16 @@
 #include <Wire.h>
-#include <Arduino_JSON.h>
 #include "FlapFunctions.h"
 #include "WifiFunctions.h"
 #include "utils.h"
 #include "env.h"
 #include "letters.h"
 #include "nvsUtils.h"
+#include "unitHealth.h"
+#include "I2C.h"
+#include "stringHandling.h"
+#include "displaySettings.h"
+#include "i2cTrace.h"
+#include "unitProtocol.h"
 
 /**
  * @purpose Maintain all unit states as a global variable
@@ -18,10 +23,33 @@ UnitState fetchedStates[MAX_NUM_UNITS];
 UnitState pendingUpdates[MAX_NUM_UNITS];
 
 /**
- * @purpose Save time from a web API request handler to serialize the unit states in a JSON string, otherwise it times out
+ * @purpose Guard pendingUpdates, which loop() writes and the web API handlers serialize on the AsyncTCP task
  */
-String pendingUpdatesSerialized = "";
+portMUX_TYPE pendingUpdatesLock = portMUX_INITIALIZER_UNLOCKED;
 
+/**
+ * @purpose Calibrations posted by the POST /unit handler, waiting for loop() to stage them. A batch of any size is handed over with a single command.
+ */
+struct PostedCalibration {
+    bool isPosted;
+    int offset;
+    int magneticZeroPositionLetterIndex;
+};
+PostedCalibration postedCalibrations[MAX_NUM_UNITS];
+portMUX_TYPE postedCalibrationsLock = portMUX_INITIALIZER_UNLOCKED;
+
+
+/**
+ * @purpose The frame, i.e. the letter index and RPM every unit should show. FRAME_LETTER_UNSENT for a unit never composed.
+ */
+uint8_t frameLetters[MAX_NUM_UNITS];
+uint8_t frameRpms[MAX_NUM_UNITS];
+
+/**
+ * @purpose The letter index every unit was last sent successfully, so that a dispatch only sends the units that change
+ */
+uint8_t sentFrameLetters[MAX_NUM_UNITS];
+unsigned long frameRefreshedAtMillis = 0;
 
 /**
  * @purpose The user set current time of the day in minutes
@@ -34,25 +62,102 @@ int offlineClockBasisInMinutes = 0;
 unsigned long offlineClockBasisSetAt = 0;
 
 /**
- * @caller Offline mode offset setting handler and magnet setting handler
- * @purpose Quickly write to the scratchpad of unit states. Update the pending updates serialized string cache, too.
+ * @caller applyPendingUpdates(), writeToUnit() and fetchUnitState()
+ * @purpose Feed the outcome of a transaction to the unit health and to the bus error rate. Probes of offline units are expected to fail and are left out of the error rate.
+ */
+void recordTransaction(int unitAddr, bool success)
+{
+  bool wasOffline = isUnitOffline(unitAddr);
+  if (success)
+  {
+    if (recordUnitSuccess(unitAddr))
+    {
+      // The unit may have missed letters while it was offline
+      invalidateFrameUnit(unitAddr);
+    }
+  }
+  else
+  {
+    recordUnitFailure(unitAddr, fetchedStates[unitAddr].lastResponseAtMillis);
+    if (isUnitOffline(unitAddr))
+    {
+      resetUnitProtocol(unitAddr);
+    }
+  }
+  if (!wasOffline)
+  {
+    recordI2CTransaction(success);
+    if (!success)
+    {
+      recordI2CSegmentFailure(getUnitSegment(unitAddr));
+    }
+  }
+}
+
+/**
+ * @caller fetchAndSetUnitStates()
+ * @purpose Quickly write to the scratchpad of unit states
  */
 void setPendingUpdates(UnitState *desiredUnitStates)
 {
-  for (int i = 0; i < MAX_NUM_UNITS; i++)
+  portENTER_CRITICAL(&pendingUpdatesLock);
+  memcpy(pendingUpdates, desiredUnitStates, sizeof(pendingUpdates));
+  portEXIT_CRITICAL(&pendingUpdatesLock);
+}
+
+/**
+ * @caller Calibration command handler in ESP.ino
+ * @purpose Stage a new offset and magnetic zero position of a unit in the scratchpad. applyPendingUpdates() sends it.
+ */
+void stageUnitCalibration(int unitAddr, int offset, int magneticZeroPositionLetterIndex)
+{
+  if (unitAddr < 0 || unitAddr >= MAX_NUM_UNITS)
   {
-    pendingUpdates[i] = desiredUnitStates[i];
+    return;
   }
-  updatePendingUpdatesSerialized();
+  portENTER_CRITICAL(&pendingUpdatesLock);
+  pendingUpdates[unitAddr].unitAddr = unitAddr;
+  pendingUpdates[unitAddr].offset = offset;
+  pendingUpdates[unitAddr].magneticZeroPositionLetterIndex = magneticZeroPositionLetterIndex;
+  portEXIT_CRITICAL(&pendingUpdatesLock);
 }
 
 /**
- * @caller POST /unit handler
- * @purpose Get a scratchpad for unit states
+ * @caller POST /unit handler in ESP.ino
+ * @purpose Hand a calibration over to loop(). A later calibration of the same unit replaces one not yet staged.
  */
-UnitState *getPendingUpdates()
+void postUnitCalibration(int unitAddr, int offset, int magneticZeroPositionLetterIndex)
 {
-  return pendingUpdates;
+  if (unitAddr < 0 || unitAddr >= MAX_NUM_UNITS)
+  {
+    return;
+  }
+  portENTER_CRITICAL(&postedCalibrationsLock);
+  postedCalibrations[unitAddr] = PostedCalibration{true, offset, magneticZeroPositionLetterIndex};
+  portEXIT_CRITICAL(&postedCalibrationsLock);
+}
+
+/**
+ * @caller Posted calibrations command handler in ESP.ino
+ * @purpose Stage every posted calibration in the scratchpad. Nothing to do if an earlier command already staged them.
+ * @return true if a calibration was staged
+ */
+bool stagePostedCalibrations()
+{
+  bool isStaged = false;
+  for (int i = 0; i < MAX_NUM_UNITS; i++)
+  {
+    portENTER_CRITICAL(&postedCalibrationsLock);
+    PostedCalibration calibration = postedCalibrations[i];
+    postedCalibrations[i].isPosted = false;
+    portEXIT_CRITICAL(&postedCalibrationsLock);
+    if (calibration.isPosted)
+    {
+      stageUnitCalibration(i, calibration.offset, calibration.magneticZeroPositionLetterIndex);
+      isStaged = true;
+    }
+  }
+  return isStaged;
 }
 
 /**
@@ -61,7 +166,7 @@ UnitState *getPendingUpdates()
  */
 void applyPendingUpdates()
 {
-  int numUnits = getNvsInt(PARAM_NUM_UNITS, 1);
+  int numUnits = getDisplaySettings().numUnits;
 
   for (int i = 0; i < numUnits; i++)
   {
@@ -69,8 +174,29 @@ void applyPendingUpdates()
     int offset = pendingUpdates[i].offset;
     int magneticZeroPositionLetterUpdateIndex = pendingUpdates[i].magneticZeroPositionLetterIndex;
 
+    int busAddress = getUnitBusAddress(address);
+
+    if (isUnitOffline(address) || busAddress == -1)
+    {
+      Serial.printf("Skipping offline unit %d\n", address);
+      continue;
+    }
+    if (!selectI2CSegmentOfUnit(address))
+    {
+      continue;
+    }
+
     Serial.printf("Updating unit %d\n", address);
-    Wire.beginTransmission(address);
+    if (getUnitProtocol(address).version == UNIT_PROTOCOL_V2)
+    {
+      uint8_t payload[] = {(uint8_t)((offset >> 8) & 0xFF), (uint8_t)(offset & 0xFF), (uint8_t)magneticZeroPositionLetterUpdateIndex};
+      bool success = sendUnitCommandV2(address, COMMAND_V2_UPDATE_OFFSET, payload, sizeof(payload), I2C_TRACE_KIND_UPDATE);
+      Serial.printf("Update acknowledged: %s\n", success ? "true" : "false");
+      recordTransaction(address, success);
+      continue;
+    }
+    uint32_t traceStartMicros = beginI2CTrace();
+    Wire.beginTransmission(busAddress);
     Wire.write(COMMAND_UPDATE_OFFSET);
     // Decompose offset into two bytes
     int offsetMSB = (offset >> 8) & 0xFF;
@@ -84,18 +210,37 @@ void applyPendingUpdates()
     Serial.printf("MagneticZeroPositionLetterIndex written: %d\n", magneticZeroPositionLetterUpdateIndex);
     int retEndTransmission = Wire.endTransmission();
     Serial.printf("EndTransmission returned: %d\n", retEndTransmission);
+    uint8_t tracePayload[] = {(uint8_t)offsetMSB, (uint8_t)offsetLSB, (uint8_t)magneticZeroPositionLetterUpdateIndex};
+    traceI2C(traceStartMicros, I2C_TRACE_KIND_UPDATE, address, busAddress, COMMAND_UPDATE_OFFSET, tracePayload, sizeof(tracePayload), retEndTransmission);
+    recordTransaction(address, retEndTransmission == 0);
   }
 }
 
 /**
- * @caller showMessage()
- * @purpose Send an I2C request to a flap unit to display a letter at a given RPM
+ * @caller dispatchFrame()
+ * @purpose Send an I2C request to a flap unit to display a letter at a given RPM. Offline units and units on a failing segment are skipped.
+ * @return true if the unit acknowledged the request
  */
-void writeToUnit(int address, int letter, int flapRpm)
+bool writeToUnit(int address, int letter, int flapRpm)
 {
+  int busAddress = getUnitBusAddress(address);
+  if (isUnitOffline(address) || busAddress == -1 || !selectI2CSegmentOfUnit(address))
+  {
+    return false;
+  }
+
+  if (getUnitProtocol(address).version == UNIT_PROTOCOL_V2)
+  {
+    uint8_t payload[] = {(uint8_t)letter, (uint8_t)flapRpm};
+    bool success = sendUnitCommandV2(address, COMMAND_V2_SHOW_LETTER, payload, sizeof(payload), I2C_TRACE_KIND_SHOW);
+    recordTransaction(address, success);
+    return success;
+  }
+
   int sendArray[2] = {letter, flapRpm}; // Array with values to send to unit
 
-  Wire.beginTransmission(address);
+  uint32_t traceStartMicros = beginI2CTrace();
+  Wire.beginTransmission(busAddress);
 
   // Send command to show letter
   Wire.write(COMMAND_SHOW_LETTER);
@@ -109,54 +254,162 @@ void writeToUnit(int address, int letter, int flapRpm)
 #endif
     Wire.write(sendArray[i]);
   }
-  Wire.endTransmission(); // send values to unit
+  int retEndTransmission = Wire.endTransmission(); // send values to unit
+  uint8_t tracePayload[] = {(uint8_t)letter, (uint8_t)flapRpm};
+  traceI2C(traceStartMicros, I2C_TRACE_KIND_SHOW, address, busAddress, COMMAND_SHOW_LETTER, tracePayload, sizeof(tracePayload), retEndTransmission);
+  recordTransaction(address, retEndTransmission == 0);
+  return retEndTransmission == 0;
 }
 
 /**
- * @caller setup() and loop() in ESP.ino
- * @purpose Decompose a message into individual letters and send each letter to a flap unit at a given RPM
+ * @caller Compose functions
+ * @purpose Set the letter and RPM a unit should show in the next dispatch
  */
-void showMessage(String message)
+void setFrameUnit(int unitAddr, int letterIndex, int flapRpm)
 {
-  Serial.println("Entering showMessage function");
-  int flapRpm = getNvsInt(PARAM_RPM);
-
-  // Format string per alignment choice
-  String alignment = getNvsString(PARAM_ALIGNMENT);
-  String alignedMessage;
-  if (alignment == "left")
+  if (unitAddr < 0 || unitAddr >= MAX_NUM_UNITS || letterIndex < 0 || letterIndex >= NUM_FLAPS)
   {
-    alignedMessage = leftString(message);
+    return;
   }
-  else if (alignment == "right")
+  frameLetters[unitAddr] = letterIndex;
+  frameRpms[unitAddr] = flapRpm;
+}
+
+/**
+ * @caller recordTransaction() and dispatchFrame()
+ * @purpose Forget what a unit was last sent, so that the next dispatch sends it again
+ */
+void invalidateFrameUnit(int unitAddr)
+{
+  if (0 <= unitAddr && unitAddr < MAX_NUM_UNITS)
   {
-    alignedMessage = rightString(message);
+    sentFrameLetters[unitAddr] = FRAME_LETTER_UNSENT;
   }
-  else if (alignment == "center")
+}
+
+/**
+ * @caller setup() in ESP.ino
+ * @purpose Start with an empty frame that nothing has been sent of
+ */
+void initFrame()
+{
+  memset(frameLetters, FRAME_LETTER_UNSENT, sizeof(frameLetters));
+  invalidateFrame();
+}
+
+/**
+ * @caller initFrame() and dispatchFrame()
+ * @purpose Forget what every unit was last sent
+ */
+void invalidateFrame()
+{
+  memset(sentFrameLetters, FRAME_LETTER_UNSENT, sizeof(sentFrameLetters));
+}
+
+/**
+ * @caller showAlignedMessage(), showFrame() and renderZones() in zones.cpp
+ * @purpose Send the frame to the units whose letter differs from the one they were last sent, in address order and thus segment by segment.
+ * Every unit is sent its letter again once in a while, in case it has lost it without ever going offline.
+ * @return The number of units sent a letter
+ */
+int dispatchFrame()
+{
+  if (millis() - frameRefreshedAtMillis >= FRAME_REFRESH_MILLIS)
   {
-    alignedMessage = centerString(message);
+    frameRefreshedAtMillis = millis();
+    invalidateFrame();
   }
 
-  int numUnits = getNvsInt(PARAM_NUM_UNITS, 1);
-  Serial.printf("rpm: %d, numUnits: %d, input message: %s, aligned message: %s\n", flapRpm, numUnits, message.c_str(), alignedMessage.c_str());
+  int numUnits = getDisplaySettings().numUnits;
+  int numSent = 0;
   for (int i = 0; i < numUnits; i++)
   {
-    char letter = alignedMessage[i];
+    if (frameLetters[i] == FRAME_LETTER_UNSENT || frameLetters[i] == sentFrameLetters[i])
+    {
+      continue;
+    }
+    if (writeToUnit(i, frameLetters[i], frameRpms[i]))
+    {
+      sentFrameLetters[i] = frameLetters[i];
+      numSent++;
+    }
+  }
+  return numSent;
+}
+
+/**
+ * @caller setup() and loop() in ESP.ino
+ * @purpose Decompose a message into individual letters and send each letter to a flap unit at the configured alignment and RPM
+ */
+void showMessage(const char *message)
+{
+  Serial.println("Entering showMessage function");
+  const DisplaySettings &settings = getDisplaySettings();
+  showAlignedMessage(message, settings.alignment, settings.rpm);
+}
+
+/**
+ * @caller showMessage() and showPlaylist() in playlist.cpp
+ * @purpose Decompose a message into individual letters across the whole wall and send each letter to a flap unit at a given alignment and RPM
+ */
+void showAlignedMessage(const char *message, const char *alignment, int flapRpm)
+{
+  composeMessage(message, alignment, flapRpm, 0, getDisplaySettings().numUnits);
+  dispatchFrame();
+}
+
+/**
+ * @caller composeMessage() and showGroupMessage() in group.cpp
+ * @purpose Align a message to a width of units and translate it into one letter index per unit.
+ * Units not covered by the message get a space, and characters without a flap get FRAME_LETTER_UNSENT, which leaves their unit as is.
+ */
+void alignMessageLetters(uint8_t *letters, int width, const char *message, const char *alignment)
+{
+  int length = strlen(message);
+  int alignedStart = getAlignedStart(length, width, alignment);
+  for (int i = 0; i < width; i++)
+  {
+    int messageIndex = i - alignedStart;
+    char letter = 0 <= messageIndex && messageIndex < length ? message[messageIndex] : ' ';
     int letterPosition = translateLetterToIndex(letter);
+    letters[i] = letterPosition == -1 ? FRAME_LETTER_UNSENT : letterPosition;
+  }
+}
+
+/**
+ * @caller showAlignedMessage() and renderZones() in zones.cpp
+ * @purpose Align a message to a range of units and put its letters into the frame
+ */
+void composeMessage(const char *message, const char *alignment, int flapRpm, int start, int width)
+{
+  // Static to keep it off the loop task stack
+  static uint8_t letters[MAX_NUM_UNITS];
+  width = min(width, MAX_NUM_UNITS);
+  alignMessageLetters(letters, width, message, alignment);
+  logF("rpm: %d, units: %d-%d, alignment: %s, message: %s\n", flapRpm, start, start + width - 1, alignment, message);
+  for (int i = 0; i < width; i++)
+  {
 #ifdef serial
     Serial.print("Unit No.: ");
-    Serial.print(i);
-    Serial.print(" Letter: ");
-    Serial.print(message[i]);
+    Serial.print(start + i);
     Serial.print(" Letter position: ");
-    Serial.println(letterPosition);
+    Serial.println(letters[i]);
 #endif
-    // only write to unit if char exists in letter array
-    if (letterPosition != -1)
-    {
-      writeToUnit(i, letterPosition, flapRpm);
-    }
+    setFrameUnit(start + i, letters[i], flapRpm);
+  }
+}
+
+/**
+ * @caller showPlaylist() in playlist.cpp
+ * @purpose Send a pre-composed frame, i.e. one letter index per unit, at a given RPM. Units beyond the frame and units marked PLAYLIST_FRAME_KEEP are left as they are.
+ */
+void showFrame(const uint8_t *letterIndices, int length, int flapRpm)
+{
+  for (int i = 0; i < length && i < MAX_NUM_UNITS; i++)
+  {
+    setFrameUnit(i, letterIndices[i], flapRpm);
   }
+  dispatchFrame();
 }
 
 /**
@@ -182,15 +435,24 @@ void setOfflineClock(char *clock) {
  * @purpose Show the current time of the day as a message
  */
 void showOfflineClock()
+{
+  char clock[6];
+  getOfflineClockString(clock, sizeof(clock));
+  showMessage(clock);
+}
+
+/**
+ * @caller showOfflineClock() and renderZones() in zones.cpp
+ * @purpose Format the current time of the day of the offline clock as "HH:MM"
+ */
+void getOfflineClockString(char *buffer, size_t size)
 {
   unsigned long currentMillis = millis();
   unsigned long elapsedMinutes = (currentMillis - offlineClockBasisSetAt) / 60000;
   unsigned long elapsedMinutesModWithOffset = (elapsedMinutes + offlineClockBasisInMinutes) % 1440;
   unsigned long elapsedHours = elapsedMinutesModWithOffset / 60;
   unsigned long elapsedMinutesMod = elapsedMinutesModWithOffset % 60;
-  char clock[6];
-  sprintf(clock, "%02d:%02d", (int)elapsedHours, (int)elapsedMinutesMod);
-  showMessage(clock);
+  snprintf(buffer, size, "%02d:%02d", (int)elapsedHours, (int)elapsedMinutesMod);
 }
 
 /**
@@ -199,33 +461,59 @@ void showOfflineClock()
  */
 UnitState fetchUnitState(int unitAddr)
 {
-  int bytesRead = Wire.requestFrom(unitAddr, ANSWER_SIZE, true);
+  int busAddress = getUnitBusAddress(unitAddr);
+  // A v2 answer is the legacy one followed by the acknowledgement of the last command and a CRC-8
+  bool isV2 = getUnitProtocol(unitAddr).version == UNIT_PROTOCOL_V2;
+  int answerSize = isV2 ? ANSWER_V2_SIZE : ANSWER_SIZE;
+  uint32_t traceStartMicros = beginI2CTrace();
+  int bytesRead = Wire.requestFrom(busAddress, answerSize, true);
 
-  if (bytesRead != ANSWER_SIZE)
+  if (bytesRead != answerSize)
   {
+    traceI2C(traceStartMicros, I2C_TRACE_KIND_FETCH, unitAddr, busAddress, I2C_TRACE_NO_COMMAND, NULL, 0, I2C_TRACE_RESULT_SHORT_READ);
     Serial.printf("Failed to read from unit %d, bytesRead: %d\n", unitAddr, bytesRead);
+    recordTransaction(unitAddr, false);
     return fetchedStates[unitAddr];
   }
-  // rotationRaw is, -1 = not connected, 0 = not rotating, 1 = rotating
-  int rotatingRaw = Wire.read();
-  unsigned long lastResponseAtMillis = rotatingRaw == -1 ? fetchedStates[unitAddr].lastResponseAtMillis : millis();
-  bool rotating = rotatingRaw == 1;
-  int offsetMSB = Wire.read();
-  int offsetLSB = Wire.read();
-  int offset = (offsetMSB << 8) | offsetLSB;
-  int magneticZeroPositionLetterIndex = Wire.read();
-  return UnitState{unitAddr, rotating, offset, magneticZeroPositionLetterIndex, lastResponseAtMillis};
+  uint8_t answer[ANSWER_V2_SIZE];
+  for (int i = 0; i < answerSize; i++)
+  {
+    answer[i] = Wire.read();
+  }
+  if (isV2 && !isV2Answer(answer))
+  {
+    traceI2C(traceStartMicros, I2C_TRACE_KIND_FETCH, unitAddr, busAddress, I2C_TRACE_NO_COMMAND, answer, ANSWER_SIZE, I2C_TRACE_RESULT_BAD_CRC);
+    Serial.printf("Corrupted answer from unit %d\n", unitAddr);
+    recordTransaction(unitAddr, false);
+    return fetchedStates[unitAddr];
+  }
+  recordTransaction(unitAddr, true);
+  traceI2C(traceStartMicros, I2C_TRACE_KIND_FETCH, unitAddr, busAddress, I2C_TRACE_NO_COMMAND, answer, ANSWER_SIZE, 0);
+  // 0 = not rotating, 1 = rotating
+  bool rotating = answer[0] == 1;
+  int offset = (answer[1] << 8) | answer[2];
+  int magneticZeroPositionLetterIndex = answer[3];
+  return UnitState{unitAddr, rotating, offset, magneticZeroPositionLetterIndex, millis()};
 }
 
 /**
  * @caller loop() in ESP.ino
- * @purpose Fetch the state from all flap units by I2C requests and update the global fetchedStates array
+ * @purpose Fetch the state from all flap units by I2C requests and update the global fetchedStates array.
+ * Units are polled in address order, i.e. segment by segment, so that each segment is selected once per tick. A segment that fails too often is skipped for the rest of the tick.
+ * Offline units and units on a skipped segment keep their last known state.
  */
 void fetchAndSetUnitStates()
 {
-  int numUnits = getNvsInt(PARAM_NUM_UNITS, 1);
+  int numUnits = getDisplaySettings().numUnits;
+  resetI2CSegmentFailures();
   for (int i = 0; i < numUnits; i++)
   {
+    fetchedStates[i].unitAddr = i;
+    if (!shouldPollUnit(i) || getUnitBusAddress(i) == -1 || !selectI2CSegmentOfUnit(i))
+    {
+      continue;
+    }
+    negotiateUnitProtocol(i);
     fetchedStates[i] = fetchUnitState(i);
   }
   setPendingUpdates(fetchedStates);
@@ -243,42 +531,76 @@ UnitState *getFetchedStates()
 }
 
 /**
- * @caller loop() in ESP.ino
- * @purpose Update the JSON string cache of the pending updates
+ * @caller serializeUnitStatesChunk()
+ * @purpose Render the next piece of the unit states JSON into the cursor. Returns false when the document is complete.
  */
-void updatePendingUpdatesSerialized()
+bool renderNextUnitStatesPiece(UnitStatesCursor &cursor)
 {
-  JSONVar j;
-  int numUnits = getNvsInt(PARAM_NUM_UNITS, 1);
-  if (numUnits <= 0)
+  char *piece = cursor.piece;
+  size_t size = sizeof(cursor.piece);
+  int length = 0;
+  if (cursor.nextUnit == -1)
+  {
+    cursor.numUnits = min(getNvsInt(PARAM_NUM_UNITS, 1), MAX_NUM_UNITS);
+    length = snprintf(piece, size, "{\"avrs\":[");
+  }
+  else if (cursor.nextUnit < cursor.numUnits)
   {
-    // Empty array for avrs
-    j["avrs"] = JSON.parse("[]");
+    int i = cursor.nextUnit;
+    portENTER_CRITICAL(&pendingUpdatesLock);
+    UnitState pendingUpdate = pendingUpdates[i];
+    portEXIT_CRITICAL(&pendingUpdatesLock);
+    UnitHealth health = getUnitHealth(i);
+    UnitProtocol protocol = getUnitProtocol(i);
+    length = snprintf(piece, size,
+                      "%s{\"unitAddr\":%d,\"segment\":%d,\"busAddr\":%d,\"rotating\":%s,\"magneticZeroPositionLetterIndex\":%d,\"offset\":%d,\"lastResponseAtMillis\":%lu,\"health\":\"%s\",\"consecutiveFailures\":%d,\"protocol\":%d,\"capabilities\":%d}",
+                      i == 0 ? "" : ",",
+                      i,
+                      getUnitSegment(i),
+                      getUnitBusAddress(i),
+                      pendingUpdate.rotating ? "true" : "false",
+                      pendingUpdate.magneticZeroPositionLetterIndex,
+                      pendingUpdate.offset,
+                      pendingUpdate.lastResponseAtMillis,
+                      getUnitHealthName(health.state),
+                      health.consecutiveFailures,
+                      protocol.version,
+                      protocol.capabilities);
+  }
+  else if (cursor.nextUnit == cursor.numUnits)
+  {
+    length = snprintf(piece, size, "],\"esp\":{\"currentMillis\":%lu}}", millis());
   }
   else
   {
-    for (int i = 0; i < numUnits; i++)
-    {
-      UnitState pendingUpdate = pendingUpdates[i];
-      j["avrs"][i]["unitAddr"] = pendingUpdate.unitAddr;
-      j["avrs"][i]["rotating"] = pendingUpdate.rotating;
-      j["avrs"][i]["magneticZeroPositionLetterIndex"] = pendingUpdate.magneticZeroPositionLetterIndex;
-      j["avrs"][i]["offset"] = pendingUpdate.offset;
-      j["avrs"][i]["lastResponseAtMillis"] = pendingUpdate.lastResponseAtMillis;
-    }
+    return false;
   }
-  j["esp"]["currentMillis"] = millis();
-  Serial.printf("Current millis: %d\n", millis());
-  pendingUpdatesSerialized = JSON.stringify(j);
+  cursor.nextUnit++;
+  cursor.pieceLength = min((size_t)max(length, 0), size - 1);
+  cursor.pieceOffset = 0;
+  return true;
 }
 
 /**
- * @caller loop() in ESP.ino
- * @purpose Quickly get the JSON string of the unit states
+ * @caller GET /unit and POST /unit handlers in ESP.ino
+ * @purpose Fill a chunked response buffer with the unit states JSON, one unit at a time, so that the document never has to be held in memory as a whole however many units there are.
+ * @return The number of bytes written. 0 when the document is complete.
  */
-String getPendingUpdatesSerialized()
+size_t serializeUnitStatesChunk(UnitStatesCursor &cursor, uint8_t *buffer, size_t maxLen)
 {
-  return pendingUpdatesSerialized;
+  size_t written = 0;
+  while (written < maxLen)
+  {
+    if (cursor.pieceOffset >= cursor.pieceLength && !renderNextUnitStatesPiece(cursor))
+    {
+      break;
+    }
+    size_t toCopy = min(cursor.pieceLength - cursor.pieceOffset, maxLen - written);
+    memcpy(buffer + written, cursor.piece + cursor.pieceOffset, toCopy);
+    cursor.pieceOffset += toCopy;
+    written += toCopy;
+  }
+  return written;
 }
 
 /**
@@ -289,7 +611,7 @@ String getPendingUpdatesSerialized()
 String getOffsetsInString()
 {
   String offsetString = "[";
-  int numUnits = getNvsInt(PARAM_NUM_UNITS, 1);
+  int numUnits = min(getNvsInt(PARAM_NUM_UNITS, 1), MAX_NUM_UNITS);
   for (int i = 0; i < numUnits; i++)
   {
     offsetString += String(pendingUpdates[i].offset);
@@ -11,19 +11,38 @@ struct UnitState {
     unsigned long lastResponseAtMillis; // millis() when the last response was received. Wraps around every 49 days.
 };
 
-void showMessage(String message);
+/**
+ * @purpose Keep track of a chunked unit states JSON response between two chunks
+ */
+struct UnitStatesCursor {
+    int nextUnit = -1;       // -1 before the opening of the document, numUnits for its closing
+    int numUnits = 0;
+    char piece[320];         // The rendered piece being copied out
+    size_t pieceLength = 0;
+    size_t pieceOffset = 0;
+};
+
+void showMessage(const char *message);
+void showAlignedMessage(const char *message, const char *alignment, int flapRpm);
+void showFrame(const uint8_t *letterIndices, int length, int flapRpm);
+void alignMessageLetters(uint8_t *letters, int width, const char *message, const char *alignment);
+void composeMessage(const char *message, const char *alignment, int flapRpm, int start, int width);
+void initFrame();
+void setFrameUnit(int unitAddr, int letterIndex, int flapRpm);
+void invalidateFrameUnit(int unitAddr);
+void invalidateFrame();
+int dispatchFrame();
+void getOfflineClockString(char *buffer, size_t size);
 void setOfflineClock(char *clock);
 void showOfflineClock();
-UnitState *getPendingUpdates();
 void setPendingUpdates(UnitState *unitStates);
+void stageUnitCalibration(int unitAddr, int offset, int magneticZeroPositionLetterIndex);
+void postUnitCalibration(int unitAddr, int offset, int magneticZeroPositionLetterIndex);
+bool stagePostedCalibrations();
 UnitState *getFetchedStates();
 void fetchAndSetUnitStates();
-String getPendingUpdatesSerialized();
-void updatePendingUpdatesSerialized();
+size_t serializeUnitStatesChunk(UnitStatesCursor &cursor, uint8_t *buffer, size_t maxLen);
 String getOffsetsInString();
 void applyPendingUpdates();
-String leftString(String message);
-String rightString(String message);
-String centerString(String message);
 
 #endif // FLAPFUNCTIONS_H
\ No newline at end of file
@@ -2,8 +2,42 @@
 #include "Wire.h"
 #include "Arduino.h"
 #include "env.h"
+#include "nvsUtils.h"
+#include "unitHealth.h"
+#include "i2cTrace.h"
+
+/**
+ * @purpose Candidate bus clocks for the benchmark, slowest first. The slowest one is the fallback of last resort.
+ */
+const uint32_t i2cClocks[NUM_I2C_CLOCKS] = {I2C_CLOCK_STANDARD, I2C_CLOCK_FAST, I2C_CLOCK_FAST_PLUS};
+
+/**
+ * @purpose The bus clock in use. Cached so that every Wire.begin() does not have to read NVS.
+ */
+uint32_t i2cClock = 0;
+
+/**
+ * @caller setup() in ESP.ino, isI2CBusStuck() and recoverI2CBus()
+ * @purpose Start the I2C bus at the persisted clock
+ */
+void beginI2C() {
+  if (i2cClock == 0) {
+    i2cClock = getNvsInt(PARAM_I2C_CLOCK, I2C_CLOCK_STANDARD);
+  }
+  Wire.begin(SDA_PIN, SCL_PIN);
+  if (!Wire.setClock(i2cClock)) {
+    Serial.printf("Failed to set I2C clock to %lu Hz, using %lu Hz\n", (unsigned long)i2cClock, (unsigned long)I2C_CLOCK_STANDARD);
+    i2cClock = I2C_CLOCK_STANDARD;
+    Wire.setClock(i2cClock);
+  }
+}
 
 bool isI2CBusStuck() {
+  // The pins stay readable while the bus is up. Tearing the bus down, which allocates the driver again, is only worth it if the idle bus looks stuck.
+  if (!(digitalRead(SDA_PIN) == LOW && digitalRead(SCL_PIN) == HIGH)) {
+    return false;
+  }
+
   Wire.end();
   pinMode(SDA_PIN, INPUT_PULLUP);
   pinMode(SCL_PIN, INPUT_PULLUP);
@@ -13,16 +47,22 @@ bool isI2CBusStuck() {
   bool sclHigh = digitalRead(SCL_PIN) == HIGH;
 
   // Turn the pins back to output
-  Wire.begin(SDA_PIN, SCL_PIN);
+  beginI2C();
 
   return sdaLow && sclHigh; // SDA low and SCL high indicates a stuck bus
 }
 
+/**
+ * @purpose The multiplexer channel currently open. -1 means unknown, e.g. after bus recovery.
+ */
+int selectedI2CSegment = -1;
+
 int numI2CBusStuck = 0;
 unsigned long lastI2CBusStuckAtMillis = 0;
 int clockUs = 8;
 
 bool recoverI2CBus() {
+  uint32_t traceStartMicros = beginI2CTrace();
   Wire.end();
   pinMode(SDA_PIN, OUTPUT);
   pinMode(SCL_PIN, OUTPUT);
@@ -43,8 +83,10 @@ bool recoverI2CBus() {
   delayMicroseconds(clockUs);
   digitalWrite(SDA_PIN, HIGH);
 
-  // Reinitialize the I2C bus
-  Wire.begin(SDA_PIN, SCL_PIN);
+  // Reinitialize the I2C bus. The multiplexers may have lost their channel selection, too.
+  beginI2C();
+  selectedI2CSegment = -1;
+  traceI2C(traceStartMicros, I2C_TRACE_KIND_RECOVER, -1, 0, I2C_TRACE_NO_COMMAND, NULL, 0, I2C_TRACE_RESULT_BUS_RECOVERED);
   Serial.println("I2C bus recovery complete.");
   numI2CBusStuck++;
   lastI2CBusStuckAtMillis = millis();
@@ -57,4 +99,329 @@ int getNumI2CBusStuck() {
 
 unsigned long getLastI2CBusStuckAtMillis() {
   return lastI2CBusStuckAtMillis;
-}
\ No newline at end of file
+}
+
+uint32_t getI2CClock() {
+  return i2cClock;
+}
+
+/**
+ * @caller recordI2CTransaction()
+ * @purpose Find the position of a clock in the candidate list. Unknown clocks count as the slowest one.
+ */
+int getI2CClockIndex(uint32_t clock) {
+  for (int i = 0; i < NUM_I2C_CLOCKS; i++) {
+    if (i2cClocks[i] == clock) {
+      return i;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @caller GET /i2c handler in ESP.ino
+ * @purpose Get a candidate clock of the benchmark by its position, slowest first
+ */
+uint32_t getI2CCandidateClock(int clockIndex) {
+  if (clockIndex < 0 || clockIndex >= NUM_I2C_CLOCKS) {
+    return I2C_CLOCK_STANDARD;
+  }
+  return i2cClocks[clockIndex];
+}
+
+/**
+ * @caller recordI2CTransaction() and runI2CBenchmark()
+ * @purpose Switch the bus clock and persist it for the next boot
+ */
+void setI2CClock(uint32_t clock) {
+  i2cClock = clock;
+  Wire.setClock(i2cClock);
+  putNvsInt(PARAM_I2C_CLOCK, i2cClock);
+  Serial.printf("I2C clock set to %lu Hz\n", (unsigned long)i2cClock);
+}
+
+int numI2CTransactionsInWindow = 0;
+int numI2CErrorsInWindow = 0;
+float lastI2CErrorRate = 0;
+int numI2CClockFallbacks = 0;
+
+/**
+ * @caller recordTransaction() in FlapFunctions.cpp
+ * @purpose Count transaction outcomes in a fixed window and fall back to the next slower clock when the error rate rises above the threshold
+ */
+void recordI2CTransaction(bool success) {
+  numI2CTransactionsInWindow++;
+  if (!success) {
+    numI2CErrorsInWindow++;
+  }
+  if (numI2CTransactionsInWindow < I2C_ERROR_WINDOW_SIZE) {
+    return;
+  }
+  lastI2CErrorRate = (float)numI2CErrorsInWindow / numI2CTransactionsInWindow;
+  numI2CTransactionsInWindow = 0;
+  numI2CErrorsInWindow = 0;
+
+  int clockIndex = getI2CClockIndex(i2cClock);
+  if (lastI2CErrorRate * 100 > I2C_MAX_ERROR_RATE_PERCENT && clockIndex > 0) {
+    Serial.printf("I2C error rate %.1f%% is above %d%%, falling back\n", lastI2CErrorRate * 100, I2C_MAX_ERROR_RATE_PERCENT);
+    numI2CClockFallbacks++;
+    setI2CClock(i2cClocks[clockIndex - 1]);
+  }
+}
+
+/**
+ * @caller GET /i2c handler in ESP.ino
+ * @purpose Get the error rate of the last complete window
+ */
+float getI2CErrorRate() {
+  return lastI2CErrorRate;
+}
+
+int getNumI2CClockFallbacks() {
+  return numI2CClockFallbacks;
+}
+
+/**
+ * @purpose The benchmark blocks the bus for a few seconds, so web API handlers only request it and loop() runs it
+ */
+volatile bool i2cBenchmarkRequested = false;
+
+/**
+ * @purpose Results of the last benchmark per unit and clock
+ */
+I2CBenchmarkResult i2cBenchmarkResults[MAX_NUM_UNITS][NUM_I2C_CLOCKS];
+unsigned long i2cBenchmarkedAtMillis = 0;
+
+/**
+ * @caller POST /i2c/benchmark handler in ESP.ino and loop() in ESP.ino
+ * @purpose Ask loop() to run the benchmark on its next tick
+ */
+void requestI2CBenchmark() {
+  i2cBenchmarkRequested = true;
+}
+
+bool isI2CBenchmarkRequested() {
+  return i2cBenchmarkRequested;
+}
+
+/**
+ * @caller loop() in ESP.ino
+ * @purpose Measure the round trip and error rate of state requests to every unit at every candidate clock.
+ * Replies at faster clocks are also checked against the reply at the slowest clock, since a corrupted offset is as bad as a missing one.
+ * Pick and persist the fastest clock whose overall error rate stays under the threshold. Offline units are left out.
+ */
+void runI2CBenchmark(int numUnits) {
+  i2cBenchmarkRequested = false;
+  numUnits = min(numUnits, MAX_NUM_UNITS);
+  Serial.printf("Running I2C benchmark on %d units\n", numUnits);
+
+  // Offset and magnetic zero position read at the slowest clock
+  struct ReferenceAnswer {
+    bool isValid;
+    uint16_t offset;
+    uint8_t magneticZeroPositionLetterIndex;
+  };
+  static ReferenceAnswer referenceAnswers[MAX_NUM_UNITS];
+  int bestClockIndex = 0;
+
+  for (int c = 0; c < NUM_I2C_CLOCKS; c++) {
+    bool clockSupported = Wire.setClock(i2cClocks[c]);
+    int numErrors = 0;
+    int numRounds = 0;
+    resetI2CSegmentFailures();
+    for (int unitAddr = 0; unitAddr < numUnits; unitAddr++) {
+      I2CBenchmarkResult &result = i2cBenchmarkResults[unitAddr][c];
+      result = I2CBenchmarkResult{0, 0, 0};
+      if (c == 0) {
+        referenceAnswers[unitAddr].isValid = false;
+      }
+      int busAddress = getUnitBusAddress(unitAddr);
+      if (!clockSupported || isUnitOffline(unitAddr) || busAddress == -1 || !selectI2CSegmentOfUnit(unitAddr)) {
+        continue;
+      }
+      unsigned long totalLatencyUs = 0;
+      for (int round = 0; round < I2C_BENCHMARK_ROUNDS; round++) {
+        unsigned long startedAtUs = micros();
+        int bytesRead = Wire.requestFrom(busAddress, ANSWER_SIZE, true);
+        totalLatencyUs += micros() - startedAtUs;
+        result.numRounds++;
+        if (bytesRead != ANSWER_SIZE) {
+          result.numErrors++;
+          continue;
+        }
+        Wire.read(); // rotating
+        // Read into variables first, since the operands of | may be evaluated in any order
+        int offsetMSB = Wire.read();
+        int offsetLSB = Wire.read();
+        int offset = (offsetMSB << 8) | offsetLSB;
+        int magneticZeroPositionLetterIndex = Wire.read();
+        ReferenceAnswer &reference = referenceAnswers[unitAddr];
+        if (!reference.isValid) {
+          reference = ReferenceAnswer{true, (uint16_t)offset, (uint8_t)magneticZeroPositionLetterIndex};
+        } else if (reference.offset != offset || reference.magneticZeroPositionLetterIndex != magneticZeroPositionLetterIndex) {
+          result.numErrors++;
+        }
+      }
+      result.avgLatencyUs = totalLatencyUs / result.numRounds;
+      numErrors += result.numErrors;
+      numRounds += result.numRounds;
+    }
+
+    float errorRate = numRounds == 0 ? 1 : (float)numErrors / numRounds;
+    Serial.printf("I2C clock %lu Hz: supported: %s, error rate: %.1f%%\n",
+                  (unsigned long)i2cClocks[c],
+                  clockSupported ? "true" : "false",
+                  errorRate * 100);
+    if (clockSupported && numRounds > 0 && errorRate * 100 <= I2C_MAX_ERROR_RATE_PERCENT) {
+      bestClockIndex = c;
+    }
+  }
+
+  i2cBenchmarkedAtMillis = millis();
+  numI2CTransactionsInWindow = 0;
+  numI2CErrorsInWindow = 0;
+  setI2CClock(i2cClocks[bestClockIndex]);
+}
+
+/**
+ * @caller GET /i2c handler in ESP.ino
+ * @purpose Get the benchmark result of a unit at a clock
+ */
+I2CBenchmarkResult getI2CBenchmarkResult(int unitAddr, int clockIndex) {
+  if (unitAddr < 0 || unitAddr >= MAX_NUM_UNITS || clockIndex < 0 || clockIndex >= NUM_I2C_CLOCKS) {
+    return I2CBenchmarkResult{0, 0, 0};
+  }
+  return i2cBenchmarkResults[unitAddr][clockIndex];
+}
+
+unsigned long getI2CBenchmarkedAtMillis() {
+  return i2cBenchmarkedAtMillis;
+}
+
+/**
+ * @purpose Number of units behind each multiplexer channel as a cache of NVS. 0 means a single bus without multiplexer. -1 means not loaded yet.
+ */
+int unitsPerSegment = -1;
+
+/**
+ * @purpose Failures of each segment in the current tick
+ */
+uint8_t i2cSegmentFailures[MAX_NUM_SEGMENTS];
+
+int getUnitsPerSegment() {
+  if (unitsPerSegment < 0) {
+    unitsPerSegment = constrain(getNvsInt(PARAM_UNITS_PER_SEGMENT, 0), 0, MAX_UNITS_PER_SEGMENT);
+  }
+  return unitsPerSegment;
+}
+
+/**
+ * @caller POST /main handler in ESP.ino
+ * @purpose Persist the number of units behind each multiplexer channel
+ */
+void setUnitsPerSegment(int numUnitsPerSegment) {
+  unitsPerSegment = constrain(numUnitsPerSegment, 0, MAX_UNITS_PER_SEGMENT);
+  putNvsInt(PARAM_UNITS_PER_SEGMENT, unitsPerSegment);
+  selectedI2CSegment = -1;
+}
+
+int getNumSegments(int numUnits) {
+  int n = getUnitsPerSegment();
+  return n == 0 ? 1 : (numUnits + n - 1) / n;
+}
+
+/**
+ * @caller FlapFunctions.cpp and runI2CBenchmark()
+ * @purpose Get the segment, i.e. the multiplexer channel, of a logical unit
+ */
+int getUnitSegment(int unitAddr) {
+  int n = getUnitsPerSegment();
+  return n == 0 ? 0 : unitAddr / n;
+}
+
+/**
+ * @caller FlapFunctions.cpp and runI2CBenchmark()
+ * @purpose Get the 7-bit address of a logical unit on its segment. -1 if the unit is out of reach of the wiring.
+ */
+int getUnitBusAddress(int unitAddr) {
+  int n = getUnitsPerSegment();
+  if (unitAddr < 0 || unitAddr >= MAX_NUM_UNITS) {
+    return -1;
+  }
+  if (n == 0) {
+    return unitAddr < MAX_UNITS_PER_BUS ? unitAddr : -1;
+  }
+  return unitAddr / n < MAX_NUM_SEGMENTS ? unitAddr % n : -1;
+}
+
+/**
+ * @caller selectI2CSegment()
+ * @purpose Open the given channels of a multiplexer and close all others
+ */
+bool writeI2CMuxChannels(int mux, uint8_t channels) {
+  Wire.beginTransmission(I2C_MUX_BASE_ADDRESS + mux);
+  Wire.write(channels);
+  return Wire.endTransmission() == 0;
+}
+
+/**
+ * @caller selectI2CSegmentOfUnit()
+ * @purpose Route the bus to a segment. Cached, so consecutive units of a segment share a single channel selection.
+ */
+bool selectI2CSegment(int segment) {
+  if (getUnitsPerSegment() == 0 || segment == selectedI2CSegment) {
+    return true;
+  }
+  int mux = segment / I2C_MUX_NUM_CHANNELS;
+  if (selectedI2CSegment == -1) {
+    // Unknown state. Close every other multiplexer so that two segments never share the bus.
+    for (int m = 0; m < I2C_MUX_MAX_MUXES; m++) {
+      if (m != mux) {
+        writeI2CMuxChannels(m, 0);
+      }
+    }
+  } else if (selectedI2CSegment / I2C_MUX_NUM_CHANNELS != mux) {
+    writeI2CMuxChannels(selectedI2CSegment / I2C_MUX_NUM_CHANNELS, 0);
+  }
+  bool success = writeI2CMuxChannels(mux, 1 << (segment % I2C_MUX_NUM_CHANNELS));
+  selectedI2CSegment = success ? segment : -1;
+  return success;
+}
+
+/**
+ * @caller FlapFunctions.cpp and runI2CBenchmark()
+ * @purpose Route the bus to the segment of a unit, unless the segment has already failed too often in this tick
+ */
+bool selectI2CSegmentOfUnit(int unitAddr) {
+  int segment = getUnitSegment(unitAddr);
+  if (segment < 0 || segment >= MAX_NUM_SEGMENTS || i2cSegmentFailures[segment] >= I2C_SEGMENT_MAX_FAILURES_PER_TICK) {
+    return false;
+  }
+  if (!selectI2CSegment(segment)) {
+    Serial.printf("Failed to select I2C segment %d, skipping it in this tick\n", segment);
+    i2cSegmentFailures[segment] = I2C_SEGMENT_MAX_FAILURES_PER_TICK;
+    return false;
+  }
+  return true;
+}
+
+/**
+ * @caller recordTransaction() in FlapFunctions.cpp
+ * @purpose Count a failed transaction against the segment of the unit
+ */
+void recordI2CSegmentFailure(int segment) {
+  if (segment < 0 || segment >= MAX_NUM_SEGMENTS) {
+    return;
+  }
+  if (i2cSegmentFailures[segment] < I2C_SEGMENT_MAX_FAILURES_PER_TICK) {
+    i2cSegmentFailures[segment]++;
+  }
+}
+
+/**
+ * @caller fetchAndSetUnitStates() in FlapFunctions.cpp and runI2CBenchmark()
+ * @purpose Give every segment a fresh failure budget at the start of a tick
+ */
+void resetI2CSegmentFailures() {
+  memset(i2cSegmentFailures, 0, sizeof(i2cSegmentFailures));
+}
@@ -1,6 +1,32 @@
 #pragma once
+#include <Arduino.h>
 
+struct I2CBenchmarkResult {
+  uint16_t avgLatencyUs; // Average round trip of a state request
+  uint8_t numErrors;     // Failed or corrupted state requests
+  uint8_t numRounds;     // State requests made
+};
+
+void beginI2C();
 bool isI2CBusStuck();
 bool recoverI2CBus();
 int getNumI2CBusStuck();
-unsigned long getLastI2CBusStuckAtMillis();
\ No newline at end of file
+unsigned long getLastI2CBusStuckAtMillis();
+uint32_t getI2CClock();
+uint32_t getI2CCandidateClock(int clockIndex);
+void recordI2CTransaction(bool success);
+float getI2CErrorRate();
+int getNumI2CClockFallbacks();
+void requestI2CBenchmark();
+bool isI2CBenchmarkRequested();
+void runI2CBenchmark(int numUnits);
+I2CBenchmarkResult getI2CBenchmarkResult(int unitAddr, int clockIndex);
+unsigned long getI2CBenchmarkedAtMillis();
+int getUnitsPerSegment();
+void setUnitsPerSegment(int numUnitsPerSegment);
+int getNumSegments(int numUnits);
+int getUnitSegment(int unitAddr);
+int getUnitBusAddress(int unitAddr);
+bool selectI2CSegmentOfUnit(int unitAddr);
+void recordI2CSegmentFailure(int segment);
+void resetI2CSegmentFailures();
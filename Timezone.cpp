@@ -5,7 +5,7 @@
 
 /**
  * @purpose Global timezone object encapsulates user's timezone state variable
- * @caller getDateString(), getClockString()
+ * @caller formatDateTime()
  */
 Timezone timezone;
 
@@ -19,20 +19,79 @@ void applyUserTimezone()
   timezone.setLocation(timezoneString);
 }
 
+const char *const dayNames[] = {"Sunday", "Monday", "Tuesday", "Wednesday", "Thursday", "Friday", "Saturday"};
+const char *const monthNames[] = {"January", "February", "March", "April", "May", "June", "July", "August", "September", "October", "November", "December"};
+
+/**
+ * @purpose Format the current time in the user's timezone like ezTime's dateTime(), but into a buffer instead of a String, so that it does not allocate.
+ * Supports d, j, D, l, N, w, m, n, M, F, Y, y, H, G, h, g, i, s, A and a. ~ escapes the next character, and other characters are copied as they are.
+ * @caller getDateString(), getClockString()
+ */
+void formatDateTime(char *buffer, size_t size, const char *format)
+{
+  time_t t = timezone.now();
+  int hour = timezone.hour(t);
+  int weekday = timezone.weekday(t) - 1; // ezTime counts from 1 = Sunday
+  int month = timezone.month(t) - 1;
+  size_t length = 0;
+  for (const char *c = format; *c != '\0' && length < size - 1; c++)
+  {
+    int written = 0;
+    char *out = buffer + length;
+    size_t left = size - length;
+    switch (*c)
+    {
+    case 'd': written = snprintf(out, left, "%02d", timezone.day(t)); break;
+    case 'j': written = snprintf(out, left, "%d", timezone.day(t)); break;
+    case 'D': written = snprintf(out, left, "%.3s", dayNames[weekday]); break;
+    case 'l': written = snprintf(out, left, "%s", dayNames[weekday]); break;
+    case 'N': written = snprintf(out, left, "%d", weekday == 0 ? 7 : weekday); break;
+    case 'w': written = snprintf(out, left, "%d", weekday); break;
+    case 'm': written = snprintf(out, left, "%02d", month + 1); break;
+    case 'n': written = snprintf(out, left, "%d", month + 1); break;
+    case 'M': written = snprintf(out, left, "%.3s", monthNames[month]); break;
+    case 'F': written = snprintf(out, left, "%s", monthNames[month]); break;
+    case 'Y': written = snprintf(out, left, "%d", timezone.year(t)); break;
+    case 'y': written = snprintf(out, left, "%02d", timezone.year(t) % 100); break;
+    case 'H': written = snprintf(out, left, "%02d", hour); break;
+    case 'G': written = snprintf(out, left, "%d", hour); break;
+    case 'h': written = snprintf(out, left, "%02d", hour % 12 == 0 ? 12 : hour % 12); break;
+    case 'g': written = snprintf(out, left, "%d", hour % 12 == 0 ? 12 : hour % 12); break;
+    case 'i': written = snprintf(out, left, "%02d", timezone.minute(t)); break;
+    case 's': written = snprintf(out, left, "%02d", timezone.second(t)); break;
+    case 'A': written = snprintf(out, left, "%s", hour < 12 ? "AM" : "PM"); break;
+    case 'a': written = snprintf(out, left, "%s", hour < 12 ? "am" : "pm"); break;
+    case '~':
+      if (c[1] != '\0')
+      {
+        c++;
+      }
+      // Fall through to copy the escaped character
+    default:
+      *out = *c;
+      out[1] = '\0';
+      written = 1;
+      break;
+    }
+    length = min(length + max(written, 0), size - 1);
+  }
+  buffer[length] = '\0';
+}
+
 /**
  * @purpose Get the current date string in the user's timezone
- * @caller showDate()
+ * @caller renderDisplay() in ESP.ino and renderZones() in zones.cpp
  */
-String getDateString()
+void getDateString(char *buffer, size_t size)
 {
-  return timezone.dateTime(DATE_FORMAT);
+  formatDateTime(buffer, size, DATE_FORMAT);
 }
 
 /**
  * @purpose Get the current clock string in the user's timezone
- * @caller showClock()
+ * @caller renderDisplay() and GET /clock in ESP.ino, and renderZones() in zones.cpp
  */
-String getClockString()
+void getClockString(char *buffer, size_t size)
 {
-  return timezone.dateTime(CLOCK_FORMAT);
-}
\ No newline at end of file
+  formatDateTime(buffer, size, CLOCK_FORMAT);
+}
@@ -3,8 +3,9 @@
 
 #include <Arduino.h>
 
-String getDateString();
-String getClockString();
+void formatDateTime(char *buffer, size_t size, const char *format);
+void getDateString(char *buffer, size_t size);
+void getClockString(char *buffer, size_t size);
 void applyUserTimezone();
 
 #endif // TIMEZONE_H
\ No newline at end of file
@@ -7,6 +7,69 @@
 #include "env.h"
 #include "files.h"
 
+/**
+ * @purpose Link state of STA mode. Written by the Wi-Fi event task and loop(), read by GET /wifi.
+ */
+WiFiLinkStatus wifiLink = {false, false, 0, 0, 0, 0, 0, 0};
+portMUX_TYPE wifiLinkLock = portMUX_INITIALIZER_UNLOCKED;
+unsigned long disconnectedAtMillis = 0; // Guarded by wifiLinkLock
+bool reconnectedSinceLastCheck = false; // Guarded by wifiLinkLock
+
+/**
+ * @purpose Reconnection schedule. loop() only.
+ */
+unsigned long reconnectBackoffMillis = WIFI_RECONNECT_MIN_BACKOFF_MILLIS;
+unsigned long nextReconnectMillis = 0;
+
+/**
+ * @caller The Wi-Fi event task
+ * @purpose Track the STA link. Reconnecting is left to superviseWiFi() on the loop task.
+ */
+void onWiFiEvent(arduino_event_id_t event, arduino_event_info_t info)
+{
+  unsigned long now = millis();
+  portENTER_CRITICAL(&wifiLinkLock);
+  if (event == ARDUINO_EVENT_WIFI_STA_DISCONNECTED)
+  {
+    wifiLink.lastDisconnectReason = info.wifi_sta_disconnected.reason;
+    // Failed reconnection attempts are reported as disconnections too
+    if (wifiLink.connected)
+    {
+      wifiLink.connected = false;
+      wifiLink.reconnecting = true;
+      wifiLink.numDisconnects++;
+      disconnectedAtMillis = now;
+    }
+  }
+  else if (event == ARDUINO_EVENT_WIFI_STA_GOT_IP)
+  {
+    wifiLink.connected = true;
+    if (wifiLink.reconnecting)
+    {
+      wifiLink.reconnecting = false;
+      wifiLink.numReconnects++;
+      wifiLink.lastReconnectMillis = now - disconnectedAtMillis;
+      wifiLink.maxReconnectMillis = max(wifiLink.maxReconnectMillis, wifiLink.lastReconnectMillis);
+      reconnectedSinceLastCheck = true;
+    }
+  }
+  portEXIT_CRITICAL(&wifiLinkLock);
+}
+
+/**
+ * @caller initWiFiSTA()
+ */
+void registerWiFiEvents()
+{
+  static bool isRegistered = false;
+  if (!isRegistered)
+  {
+    WiFi.onEvent(onWiFiEvent, ARDUINO_EVENT_WIFI_STA_DISCONNECTED);
+    WiFi.onEvent(onWiFiEvent, ARDUINO_EVENT_WIFI_STA_GOT_IP);
+    isRegistered = true;
+  }
+}
+
 /**
  * @caller initWiFi()
  * @purpose Initialize WiFi in STA mode
@@ -25,20 +88,33 @@ bool initWiFiSTA()
   bool useStaticIP = ipAssignment == "static";
   if (useStaticIP)
   {
-    String localIpStr = getNvsString("localIp", "192.168.10.123");
-    String gatewayStr = getNvsString("gateway", "192.168.10.1");
-    String subnetStr = getNvsString("subnet", "255.255.255.0");
-    localIpStr = String("192.168.10.123");
-    Serial.print("Setting static IP address to ");
-    Serial.println(localIpStr);
-    IPAddress localIp(localIpStr.c_str());
-    IPAddress gateway(gatewayStr.c_str());
-    IPAddress subnet(subnetStr.c_str());
-    if (!WiFi.config(localIp, gateway, subnet))
+    String localIpStr = getNvsString("ip", "");
+    IPAddress localIp;
+    IPAddress gateway;
+    IPAddress subnet;
+    IPAddress dns;
+    if (!localIp.fromString(localIpStr) || !gateway.fromString(getNvsString("gateway", "")) || !subnet.fromString(getNvsString("subnet", "255.255.255.0")))
     {
-      Serial.println("STA with static IP address assignment failed to configure");
+      Serial.println("Static IP address settings are invalid, using DHCP");
+    }
+    else
+    {
+      // Without a DNS server, resolve with the gateway as most routers do
+      if (!dns.fromString(getNvsString("dns", "")))
+      {
+        dns = gateway;
+      }
+      Serial.print("Setting static IP address to ");
+      Serial.println(localIpStr);
+      if (!WiFi.config(localIp, gateway, subnet, dns))
+      {
+        Serial.println("STA with static IP address assignment failed to configure");
+      }
     }
   }
+  // The core retries a failed association during the bounded wait below. Once connected, the link supervisor takes over.
+  WiFi.setAutoReconnect(true);
+  registerWiFiEvents();
   WiFi.begin(ssid, password);
   int count = 0;
   while (WiFi.status() != WL_CONNECTED)
@@ -59,6 +135,12 @@ bool initWiFiSTA()
     }
     count++;
   }
+  // The link supervisor reconnects with backoff instead of the core
+  WiFi.setAutoReconnect(false);
+  portENTER_CRITICAL(&wifiLinkLock);
+  wifiLink.connected = true;
+  portEXIT_CRITICAL(&wifiLinkLock);
+  reconnectBackoffMillis = WIFI_RECONNECT_MIN_BACKOFF_MILLIS;
   return true;
 }
 
@@ -82,6 +164,11 @@ bool initWiFiAP()
  */
 int initWiFi(int requestedOperationMode)
 {
+  // Leaving STA mode is not a dropped link
+  portENTER_CRITICAL(&wifiLinkLock);
+  wifiLink.connected = false;
+  wifiLink.reconnecting = false;
+  portEXIT_CRITICAL(&wifiLinkLock);
   bool success = false;
   int operationMode = requestedOperationMode;
   switch (operationMode)
@@ -126,3 +213,62 @@ int initWiFi(int requestedOperationMode)
   Serial.println(WiFi.localIP());
   return operationMode;
 }
+
+/**
+ * @caller loop() in ESP.ino, on every iteration
+ * @purpose Reconnect a dropped STA link in the background. Attempts are spaced by a doubling backoff with jitter,
+ * so that the walls of a room do not all hit the access point at once after it restarts.
+ * @return true once the link is back after a drop
+ */
+bool superviseWiFi(int operationMode)
+{
+  if (operationMode != OPERATION_MODE_STA)
+  {
+    return false;
+  }
+  portENTER_CRITICAL(&wifiLinkLock);
+  bool isReconnecting = wifiLink.reconnecting;
+  bool isReconnected = reconnectedSinceLastCheck;
+  reconnectedSinceLastCheck = false;
+  portEXIT_CRITICAL(&wifiLinkLock);
+
+  unsigned long now = millis();
+  if (isReconnected)
+  {
+    reconnectBackoffMillis = WIFI_RECONNECT_MIN_BACKOFF_MILLIS;
+    Serial.printf("Wi-Fi reconnected in %lu ms, IP: %s\n", getWiFiLinkStatus().lastReconnectMillis, WiFi.localIP().toString().c_str());
+  }
+  if (!isReconnecting)
+  {
+    // The first attempt comes a whole minimum backoff after the drop
+    nextReconnectMillis = now + reconnectBackoffMillis;
+    return isReconnected;
+  }
+  if ((long)(now - nextReconnectMillis) < 0)
+  {
+    return false;
+  }
+
+  // Wait between half and all of the backoff
+  unsigned long waitMillis = reconnectBackoffMillis / 2 + esp_random() % (reconnectBackoffMillis / 2 + 1);
+  nextReconnectMillis = now + waitMillis;
+  reconnectBackoffMillis = min(reconnectBackoffMillis * 2, (unsigned long)WIFI_RECONNECT_MAX_BACKOFF_MILLIS);
+  portENTER_CRITICAL(&wifiLinkLock);
+  wifiLink.numReconnectAttempts++;
+  portEXIT_CRITICAL(&wifiLinkLock);
+  Serial.printf("Wi-Fi link down, reconnecting. Next attempt in %lu ms\n", waitMillis);
+  // Returns right away, the outcome arrives as an event
+  WiFi.reconnect();
+  return false;
+}
+
+/**
+ * @caller GET /wifi handler in ESP.ino
+ */
+WiFiLinkStatus getWiFiLinkStatus()
+{
+  portENTER_CRITICAL(&wifiLinkLock);
+  WiFiLinkStatus status = wifiLink;
+  portEXIT_CRITICAL(&wifiLinkLock);
+  return status;
+}
@@ -3,7 +3,21 @@
 #ifndef WIFIFUNCTIONS_H
 #define WIFIFUNCTIONS_H
 
+#include <Arduino.h>
+
+struct WiFiLinkStatus {
+    bool connected;
+    bool reconnecting;                  // The STA link dropped and is not back yet
+    unsigned long numDisconnects;       // Drops of the STA link since boot
+    unsigned long numReconnects;        // Drops that were recovered
+    unsigned long numReconnectAttempts;
+    unsigned long lastReconnectMillis;  // Time from the last drop to getting an IP address again
+    unsigned long maxReconnectMillis;
+    int lastDisconnectReason;           // wifi_err_reason_t of the last disconnection event, 0 if none
+};
 
 int initWiFi(int operationMode);
+bool superviseWiFi(int operationMode);
+WiFiLinkStatus getWiFiLinkStatus();
 
 #endif // WIFIFUNCTIONS_H
\ No newline at end of file
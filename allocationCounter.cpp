@@ -0,0 +1,109 @@
+#include "sdkconfig.h"
+#include <esp_heap_caps.h>
+#include "allocationCounter.h"
+#include "env.h"
+
+/**
+ * @purpose The task whose allocations are being counted, NULL outside of a counted section
+ */
+TaskHandle_t countedTaskHandle = NULL;
+volatile unsigned long numCountedAllocations = 0;
+size_t allocatedBlocksAtBegin = 0;
+
+/**
+ * @purpose Written by loop(), read by GET /heap
+ */
+AllocationStats allocationStats = {false, 0, 0, 0, 0};
+portMUX_TYPE allocationStatsLock = portMUX_INITIALIZER_UNLOCKED;
+
+#ifdef CONFIG_HEAP_USE_HOOKS
+/**
+ * @purpose Called by the heap on every allocation of every task when the core is built with heap hooks
+ */
+void esp_heap_trace_alloc_hook(void *ptr, size_t size, uint32_t caps)
+{
+  if (countedTaskHandle != NULL && xTaskGetCurrentTaskHandle() == countedTaskHandle)
+  {
+    numCountedAllocations++;
+  }
+}
+#endif
+
+/**
+ * @caller beginAllocationCount() and endAllocationCount()
+ */
+size_t getAllocatedBlocks()
+{
+  multi_heap_info_t info;
+  heap_caps_get_info(&info, MALLOC_CAP_8BIT);
+  return info.allocated_blocks;
+}
+
+/**
+ * @caller loop() in ESP.ino
+ * @purpose Start counting the heap allocations of the calling task.
+ * Without heap hooks in the core, the count is the growth of the allocated blocks of all tasks, which misses blocks freed before the end of the count.
+ */
+void beginAllocationCount()
+{
+  numCountedAllocations = 0;
+  allocatedBlocksAtBegin = getAllocatedBlocks();
+  countedTaskHandle = xTaskGetCurrentTaskHandle();
+}
+
+/**
+ * @caller loop() in ESP.ino
+ * @purpose Record the allocations since beginAllocationCount(). In SOAK_TEST builds, a tick that allocates after the warm-up aborts.
+ * Only exact counts abort, since the fallback also counts the blocks allocated by other tasks meanwhile.
+ */
+void endAllocationCount()
+{
+  if (countedTaskHandle == NULL)
+  {
+    return;
+  }
+  countedTaskHandle = NULL;
+#ifdef CONFIG_HEAP_USE_HOOKS
+  bool exact = true;
+  unsigned long numAllocations = numCountedAllocations;
+#else
+  bool exact = false;
+  size_t allocatedBlocks = getAllocatedBlocks();
+  unsigned long numAllocations = allocatedBlocks > allocatedBlocksAtBegin ? allocatedBlocks - allocatedBlocksAtBegin : 0;
+#endif
+
+  portENTER_CRITICAL(&allocationStatsLock);
+  allocationStats.exact = exact;
+  allocationStats.numTicks++;
+  allocationStats.lastTickAllocations = numAllocations;
+  bool warmedUp = allocationStats.numTicks > ALLOCATION_SOAK_WARMUP_TICKS;
+  if (warmedUp && numAllocations > 0)
+  {
+    allocationStats.numTicksWithAllocations++;
+    allocationStats.maxTickAllocations = max(allocationStats.maxTickAllocations, numAllocations);
+  }
+#ifdef SOAK_TEST
+  unsigned long numTicks = allocationStats.numTicks;
+#endif
+  portEXIT_CRITICAL(&allocationStatsLock);
+
+#ifdef SOAK_TEST
+  if (exact && warmedUp && numAllocations > 0)
+  {
+    Serial.printf("SOAK_TEST failed: %lu heap allocations in tick %lu\n", numAllocations, numTicks);
+    Serial.flush();
+    abort();
+  }
+#endif
+}
+
+/**
+ * @caller GET /heap handler in ESP.ino
+ */
+AllocationStats getAllocationStats()
+{
+  portENTER_CRITICAL(&allocationStatsLock);
+  AllocationStats stats = allocationStats;
+  portEXIT_CRITICAL(&allocationStatsLock);
+  return stats;
+}
@@ -0,0 +1,18 @@
+#ifndef ALLOCATIONCOUNTER_H
+#define ALLOCATIONCOUNTER_H
+
+#include <Arduino.h>
+
+struct AllocationStats {
+    bool exact;                         // true if every allocation is counted, false if estimated from the number of allocated blocks
+    unsigned long numTicks;             // Ticks counted since boot
+    unsigned long lastTickAllocations;  // Allocations of the last counted tick
+    unsigned long maxTickAllocations;   // Most allocations of a tick after the warm-up
+    unsigned long numTicksWithAllocations; // Ticks after the warm-up that allocated
+};
+
+void beginAllocationCount();
+void endAllocationCount();
+AllocationStats getAllocationStats();
+
+#endif // ALLOCATIONCOUNTER_H
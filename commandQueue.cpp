@@ -0,0 +1,190 @@
+#include "commandQueue.h"
+
+/**
+ * @purpose Commands from the web API handlers, which all run on the AsyncTCP task, to loop()
+ */
+LoopCommandQueue webCommands;
+
+/**
+ * @purpose Values fetched by the feed task to loop()
+ */
+LoopCommandQueue feedCommands;
+
+/**
+ * @purpose The task running loop(), woken up whenever a command is enqueued
+ */
+TaskHandle_t loopTaskHandle = NULL;
+
+/**
+ * @caller Producer task only
+ * @purpose Append a command. Fails if the queue is full.
+ */
+bool LoopCommandQueue::push(const LoopCommand &command)
+{
+  uint32_t currentTail = tail.load(std::memory_order_relaxed);
+  if (currentTail - head.load(std::memory_order_acquire) >= LOOP_COMMAND_QUEUE_SIZE)
+  {
+    return false;
+  }
+  slots[currentTail % LOOP_COMMAND_QUEUE_SIZE] = command;
+  tail.store(currentTail + 1, std::memory_order_release);
+  return true;
+}
+
+/**
+ * @caller Consumer task only
+ * @purpose Take the oldest command. Fails if the queue is empty.
+ */
+bool LoopCommandQueue::pop(LoopCommand &command)
+{
+  uint32_t currentHead = head.load(std::memory_order_relaxed);
+  if (currentHead == tail.load(std::memory_order_acquire))
+  {
+    return false;
+  }
+  command = slots[currentHead % LOOP_COMMAND_QUEUE_SIZE];
+  head.store(currentHead + 1, std::memory_order_release);
+  return true;
+}
+
+/**
+ * @caller Producer task only
+ * @purpose Count the slots that can be pushed without failing. The consumer can only free more slots meanwhile.
+ */
+int LoopCommandQueue::freeSlots() const
+{
+  return LOOP_COMMAND_QUEUE_SIZE - (int)(tail.load(std::memory_order_relaxed) - head.load(std::memory_order_acquire));
+}
+
+LoopCommand makeTextCommand(int type, const char *text)
+{
+  LoopCommand command = {type, -1, 0, 0, ""};
+  strncpy(command.text, text == NULL ? "" : text, sizeof(command.text) - 1);
+  return command;
+}
+
+LoopCommand makeIntCommand(int type, int value)
+{
+  return LoopCommand{type, -1, value, 0, ""};
+}
+
+LoopCommand makeCalibrationCommand(int unitAddr, int offset, int magneticZeroPositionLetterIndex)
+{
+  return LoopCommand{LOOP_COMMAND_CALIBRATE_UNIT, unitAddr, offset, magneticZeroPositionLetterIndex, ""};
+}
+
+LoopCommand makeGroupCommand(int role, int totalUnits, int unitOffset)
+{
+  return LoopCommand{LOOP_COMMAND_SET_GROUP, unitOffset, role, totalUnits, ""};
+}
+
+/**
+ * @purpose Carry a validated feed configuration. NULL fields and an interval of 0 are left as they are.
+ */
+LoopCommand makeFeedConfigCommand(const char *url, const char *path, int intervalSec)
+{
+  static_assert(FEED_CONFIG_PATH_OFFSET + FEED_PATH_MAX_LENGTH < LOOP_COMMAND_TEXT_SIZE, "The feed URL and path must fit in a command");
+  LoopCommand command = {LOOP_COMMAND_SET_FEED_CONFIG, -1, intervalSec, 0, ""};
+  if (url != NULL)
+  {
+    strncpy(command.text, url, FEED_URL_MAX_LENGTH);
+    command.value2 |= FEED_CONFIG_URL;
+  }
+  if (path != NULL)
+  {
+    strncpy(command.text + FEED_CONFIG_PATH_OFFSET, path, FEED_PATH_MAX_LENGTH);
+    command.value2 |= FEED_CONFIG_PATH;
+  }
+  if (intervalSec != 0)
+  {
+    command.value2 |= FEED_CONFIG_INTERVAL;
+  }
+  return command;
+}
+
+/**
+ * @caller setup() in ESP.ino
+ * @purpose Register the task to wake up on new commands
+ */
+void setLoopTaskHandle(TaskHandle_t taskHandle)
+{
+  loopTaskHandle = taskHandle;
+}
+
+/**
+ * @caller enqueueLoopCommand() and enqueueFeedCommand()
+ * @purpose Hand a command over to loop() and wake it up. If loop() is busy and the queue is full, wait a little for it to drain.
+ * @return false if the queue stayed full
+ */
+bool enqueueCommand(LoopCommandQueue &queue, const LoopCommand &command)
+{
+  unsigned long startedAtMillis = millis();
+  while (!queue.push(command))
+  {
+    if (millis() - startedAtMillis >= LOOP_COMMAND_ENQUEUE_TIMEOUT_MILLIS)
+    {
+      Serial.printf("Loop command queue is full, dropping command %d\n", command.type);
+      return false;
+    }
+    vTaskDelay(1);
+  }
+  if (loopTaskHandle != NULL)
+  {
+    xTaskNotifyGive(loopTaskHandle);
+  }
+  return true;
+}
+
+/**
+ * @caller Web API handlers in ESP.ino, before enqueueing several commands of one request
+ * @purpose Wait a little for loop() to drain the queue until all of the commands fit, so that a request is never applied halfway
+ * @return false if the queue stayed too full
+ */
+bool reserveLoopCommands(int count)
+{
+  unsigned long startedAtMillis = millis();
+  while (webCommands.freeSlots() < count)
+  {
+    if (millis() - startedAtMillis >= LOOP_COMMAND_ENQUEUE_TIMEOUT_MILLIS)
+    {
+      Serial.printf("Loop command queue is full, dropping %d commands\n", count);
+      return false;
+    }
+    vTaskDelay(1);
+  }
+  return true;
+}
+
+/**
+ * @caller Web API handlers in ESP.ino
+ */
+bool enqueueLoopCommand(const LoopCommand &command)
+{
+  return enqueueCommand(webCommands, command);
+}
+
+/**
+ * @caller The feed task in feed.cpp
+ */
+bool enqueueFeedCommand(const LoopCommand &command)
+{
+  return enqueueCommand(feedCommands, command);
+}
+
+/**
+ * @caller loop() in ESP.ino
+ * @purpose Take the oldest command of either queue. Each queue has a single producer, so they cannot be merged.
+ */
+bool dequeueLoopCommand(LoopCommand &command)
+{
+  return webCommands.pop(command) || feedCommands.pop(command);
+}
+
+/**
+ * @caller loop() in ESP.ino
+ * @purpose Sleep until a command is enqueued or the timeout elapses, whichever comes first
+ */
+void waitForLoopCommands(unsigned long timeoutMillis)
+{
+  ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(timeoutMillis));
+}
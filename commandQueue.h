@@ -0,0 +1,47 @@
+#ifndef COMMANDQUEUE_H
+#define COMMANDQUEUE_H
+
+#include <Arduino.h>
+#include <atomic>
+#include "env.h"
+
+/**
+ * @purpose A change requested from outside loop(), e.g. by a web API handler, to be applied by loop()
+ */
+struct LoopCommand {
+    int type;                          // LOOP_COMMAND_*
+    int unitAddr;                      // Unit to calibrate, or group unit offset
+    int value;                         // rpm, numUnits, unitsPerSegment, offset, group role or feed interval
+    int value2;                        // magneticZeroPositionLetterIndex, group total units or FEED_CONFIG_* flags
+    char text[LOOP_COMMAND_TEXT_SIZE]; // text, mode, alignment, timezone, or feed URL and path
+};
+
+/**
+ * @purpose Bounded single-producer/single-consumer ring of commands.
+ * Only the producer task writes tail and only the consumer task writes head, so no lock is needed. Each side publishes its index with release and reads the other side's with acquire.
+ */
+class LoopCommandQueue {
+public:
+    bool push(const LoopCommand &command);
+    bool pop(LoopCommand &command);
+    int freeSlots() const;
+
+private:
+    LoopCommand slots[LOOP_COMMAND_QUEUE_SIZE];
+    std::atomic<uint32_t> head{0}; // Next slot to pop
+    std::atomic<uint32_t> tail{0}; // Next slot to push
+};
+
+LoopCommand makeTextCommand(int type, const char *text);
+LoopCommand makeIntCommand(int type, int value);
+LoopCommand makeCalibrationCommand(int unitAddr, int offset, int magneticZeroPositionLetterIndex);
+LoopCommand makeGroupCommand(int role, int totalUnits, int unitOffset);
+LoopCommand makeFeedConfigCommand(const char *url, const char *path, int intervalSec);
+void setLoopTaskHandle(TaskHandle_t taskHandle);
+bool reserveLoopCommands(int count);
+bool enqueueLoopCommand(const LoopCommand &command);
+bool enqueueFeedCommand(const LoopCommand &command);
+bool dequeueLoopCommand(LoopCommand &command);
+void waitForLoopCommands(unsigned long timeoutMillis);
+
+#endif // COMMANDQUEUE_H
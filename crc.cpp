@@ -0,0 +1,18 @@
+#include "crc.h"
+
+/**
+ * @caller Framed protocols
+ * @purpose CRC-8 with polynomial 0x07 (CRC-8/SMBUS). Pass the previous result as crc to continue over several buffers.
+ */
+uint8_t crc8(const uint8_t *data, size_t length, uint8_t crc)
+{
+  for (size_t i = 0; i < length; i++)
+  {
+    crc ^= data[i];
+    for (int bit = 0; bit < 8; bit++)
+    {
+      crc = crc & 0x80 ? (crc << 1) ^ 0x07 : crc << 1;
+    }
+  }
+  return crc;
+}
@@ -0,0 +1,8 @@
+#ifndef CRC_H
+#define CRC_H
+
+#include <Arduino.h>
+
+uint8_t crc8(const uint8_t *data, size_t length, uint8_t crc = 0);
+
+#endif // CRC_H
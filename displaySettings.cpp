@@ -0,0 +1,67 @@
+#include "displaySettings.h"
+#include "nvsUtils.h"
+
+/**
+ * @purpose Written by loop() only. Other tasks read NVS instead.
+ */
+DisplaySettings displaySettings;
+
+/**
+ * @caller loadDisplaySettings() and the setters
+ */
+void copySetting(char *destination, size_t size, const char *value)
+{
+  strncpy(destination, value, size - 1);
+  destination[size - 1] = '\0';
+}
+
+/**
+ * @caller setup() in ESP.ino
+ * @purpose Fill the cache from NVS, with the same defaults as GET /main
+ */
+void loadDisplaySettings()
+{
+  copySetting(displaySettings.mode, sizeof(displaySettings.mode), getNvsString(PARAM_MODE, "text").c_str());
+  copySetting(displaySettings.alignment, sizeof(displaySettings.alignment), getNvsString(PARAM_ALIGNMENT, "left").c_str());
+  copySetting(displaySettings.text, sizeof(displaySettings.text), getNvsString(PARAM_TEXT, "").c_str());
+  displaySettings.rpm = getNvsInt(PARAM_RPM, 10);
+  displaySettings.numUnits = constrain(getNvsInt(PARAM_NUM_UNITS, 1), 0, MAX_NUM_UNITS);
+}
+
+/**
+ * @caller loop() and the functions it calls
+ */
+const DisplaySettings &getDisplaySettings()
+{
+  return displaySettings;
+}
+
+void setDisplayMode(const char *mode)
+{
+  putNvsString(PARAM_MODE, mode);
+  copySetting(displaySettings.mode, sizeof(displaySettings.mode), mode);
+}
+
+void setDisplayAlignment(const char *alignment)
+{
+  putNvsString(PARAM_ALIGNMENT, alignment);
+  copySetting(displaySettings.alignment, sizeof(displaySettings.alignment), alignment);
+}
+
+void setDisplayText(const char *text)
+{
+  putNvsString(PARAM_TEXT, text);
+  copySetting(displaySettings.text, sizeof(displaySettings.text), text);
+}
+
+void setDisplayRpm(int rpm)
+{
+  putNvsInt(PARAM_RPM, rpm);
+  displaySettings.rpm = rpm;
+}
+
+void setDisplayNumUnits(int numUnits)
+{
+  putNvsInt(PARAM_NUM_UNITS, numUnits);
+  displaySettings.numUnits = constrain(numUnits, 0, MAX_NUM_UNITS);
+}
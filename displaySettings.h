@@ -0,0 +1,26 @@
+#ifndef DISPLAYSETTINGS_H
+#define DISPLAYSETTINGS_H
+
+#include <Arduino.h>
+#include "env.h"
+
+/**
+ * @purpose The display configuration read by loop() every tick, mirrored from NVS so that reading it allocates nothing
+ */
+struct DisplaySettings {
+    char mode[DISPLAY_MODE_SIZE];
+    char alignment[DISPLAY_ALIGNMENT_SIZE];
+    char text[MAX_NUM_UNITS + 1];
+    int rpm;
+    int numUnits;                      // Clamped to MAX_NUM_UNITS
+};
+
+void loadDisplaySettings();
+const DisplaySettings &getDisplaySettings();
+void setDisplayMode(const char *mode);
+void setDisplayAlignment(const char *alignment);
+void setDisplayText(const char *text);
+void setDisplayRpm(int rpm);
+void setDisplayNumUnits(int numUnits);
+
+#endif // DISPLAYSETTINGS_H
@@ -7,6 +7,9 @@
 #endif
 */
 
+// Uncomment the following line to abort on any heap allocation of a steady-state tick, for soak tests
+// #define SOAK_TEST
+
 #define MODE_PIN 9 // Pin for boot mode as well as operation mode
 #define LED_PIN 10 // Pin for the LED
 
@@ -21,17 +24,186 @@
 #define SDA_PIN 6
 #define SCL_PIN 7
 
+#define I2C_CLOCK_STANDARD 100000
+#define I2C_CLOCK_FAST 400000
+#define I2C_CLOCK_FAST_PLUS 1000000
+#define NUM_I2C_CLOCKS 3
+#define I2C_BENCHMARK_ROUNDS 10    // State requests per unit and clock in a benchmark
+#define I2C_MAX_ERROR_RATE_PERCENT 2 // Highest acceptable error rate of a clock
+#define I2C_ERROR_WINDOW_SIZE 200   // Transactions per runtime error rate sample
+
+// TCA9548A-style multiplexers. Multiplexer m answers at I2C_MUX_BASE_ADDRESS + m, and segment s is channel s % 8 of multiplexer s / 8.
+#define I2C_MUX_BASE_ADDRESS 0x70
+#define I2C_MUX_NUM_CHANNELS 8
+#define I2C_MUX_MAX_MUXES 8
+#define MAX_NUM_SEGMENTS (I2C_MUX_NUM_CHANNELS * I2C_MUX_MAX_MUXES)
+#define MAX_UNITS_PER_SEGMENT 112                // Unit addresses 0x00-0x6F. 0x70 and above belong to the multiplexers.
+#define I2C_SEGMENT_MAX_FAILURES_PER_TICK 4      // A segment failing this often is skipped for the rest of the tick
+
+#define I2C_TRACE_SIZE 512        // Transactions kept in the trace ring buffer
+#define I2C_TRACE_PAYLOAD_SIZE 4  // Bytes kept per transaction, enough for every command and answer
+#define I2C_TRACE_NO_COMMAND 0xFF // Reads and bus recoveries send no command byte
+#define I2C_TRACE_KIND_SHOW 0
+#define I2C_TRACE_KIND_UPDATE 1
+#define I2C_TRACE_KIND_FETCH 2
+#define I2C_TRACE_KIND_RECOVER 3
+#define I2C_TRACE_KIND_HELLO 4
+#define I2C_TRACE_RESULT_SHORT_READ 6    // After the Wire.endTransmission() codes 0-5
+#define I2C_TRACE_RESULT_BUS_RECOVERED 7
+#define I2C_TRACE_RESULT_BAD_CRC 8       // An answer failed its CRC-8
+#define I2C_TRACE_RESULT_NOT_ACKNOWLEDGED 9 // The answer to a v2 command had another sequence number or a failure status
+#define I2C_TRACE_STATE_OFF 0
+#define I2C_TRACE_STATE_ARMED 1     // Recording and waiting for the trigger
+#define I2C_TRACE_STATE_TRIGGERED 2 // Recording the transactions after the trigger
+#define I2C_TRACE_STATE_DONE 3      // Frozen until armed again
+#define I2C_TRACE_TRIGGER_IMMEDIATE 0
+#define I2C_TRACE_TRIGGER_ERROR 1   // A transaction with a non-zero result
+#define I2C_TRACE_TRIGGER_UNIT 2    // A transaction with a given unit
+#define I2C_TRACE_FORMAT_CSV 0
+#define I2C_TRACE_FORMAT_VCD 1
+
 #define ANSWER_SIZE 4
-#define MAX_NUM_UNITS 128
+#define MAX_NUM_UNITS 512
+#define MAX_UNITS_PER_BUS 128 // 7-bit addresses on a bus without multiplexer
 #define NUM_FLAPS 45
 
 #define COMMAND_UPDATE_OFFSET 0
 #define COMMAND_SHOW_LETTER 1
 
+// Protocol v2. Commands carry a sequence number and a CRC-8, and answers end with the sequence number and status of the last command and a CRC-8.
+// v2 units still accept the commands above, so units are written the legacy way until the handshake tells them apart.
+#define COMMAND_HELLO 2                  // Followed by PROTOCOL_V2_MAGIC and a CRC-8. The next answer of a v2 unit is a hello answer.
+#define COMMAND_V2_UPDATE_OFFSET 0x10
+#define COMMAND_V2_SHOW_LETTER 0x11
+#define PROTOCOL_V2_MAGIC 0xF2           // Never the first byte of a legacy answer, which is 0 or 1
+#define HELLO_ANSWER_SIZE 4              // Magic, version, capabilities, CRC-8
+#define ANSWER_V2_SIZE 7                 // The legacy answer, sequence number, status, CRC-8
+#define PROTOCOL_V2_MAX_COMMAND_SIZE 8
+#define PROTOCOL_V2_MAX_RETRIES 2        // Resends of a command that was not acknowledged, with the same sequence number
+#define PROTOCOL_V2_TURNAROUND_MICROS 500 // Wait between a hello or an acknowledged command and the read of its answer, for the unit to prepare it
+#define PROTOCOL_V2_STATUS_OK 0
+#define PROTOCOL_V2_STATUS_BAD_CRC 1
+#define PROTOCOL_V2_STATUS_BAD_COMMAND 2
+#define UNIT_CAPABILITY_ACKED_WRITES 0x01 // The unit reports the sequence number and status of each command
+#define UNIT_PROTOCOL_UNKNOWN 0
+#define UNIT_PROTOCOL_LEGACY 1
+#define UNIT_PROTOCOL_V2 2
+
+#define UNIT_HEALTH_ONLINE 0
+#define UNIT_HEALTH_DEGRADED 1
+#define UNIT_HEALTH_OFFLINE 2
+
+#define UNIT_OFFLINE_AFTER_FAILURES 3       // Consecutive failed transactions before a unit goes offline
+#define UNIT_OFFLINE_SILENCE_MILLIS 10000   // A degraded unit silent for this long goes offline
+#define UNIT_PROBE_BACKOFF_MIN_MILLIS 2000  // First wait before re-probing an offline unit
+#define UNIT_PROBE_BACKOFF_MAX_MILLIS 60000 // Longest wait between two probes of an offline unit
+
+#define LOOP_COMMAND_SET_TEXT 0
+#define LOOP_COMMAND_SET_MODE 1
+#define LOOP_COMMAND_SET_ALIGNMENT 2
+#define LOOP_COMMAND_SET_RPM 3
+#define LOOP_COMMAND_SET_NUM_UNITS 4
+#define LOOP_COMMAND_SET_UNITS_PER_SEGMENT 5
+#define LOOP_COMMAND_SET_TIMEZONE 6
+#define LOOP_COMMAND_CALIBRATE_UNIT 7
+#define LOOP_COMMAND_RUN_I2C_BENCHMARK 8
+#define LOOP_COMMAND_START_PLAYLIST 9
+#define LOOP_COMMAND_SET_ZONES 10
+#define LOOP_COMMAND_SET_FEED_VALUE 11
+#define LOOP_COMMAND_SET_GROUP 12
+#define LOOP_COMMAND_ACTIVATE_PLAYLIST 13
+#define LOOP_COMMAND_SET_UNIT_PROTOCOL_V2 14
+#define LOOP_COMMAND_CALIBRATE_POSTED_UNITS 15
+#define LOOP_COMMAND_SET_FEED_CONFIG 16
+
+#define LOOP_COMMAND_QUEUE_SIZE 16                // Slots of the command queue to loop()
+#define LOOP_COMMAND_TEXT_SIZE (MAX_NUM_UNITS + 1) // Long enough for a text filling every unit
+#define LOOP_COMMAND_ENQUEUE_TIMEOUT_MILLIS 500    // Longest wait of a web API handler for a free slot
+#define LOOP_TICK_MILLIS 1000                      // Period of polling and rendering
+#define LOOP_IDLE_WAIT_MILLIS 20                   // Longest sleep between two checks of the mode button
+
+#define PLAYLIST_PATH "/playlist.bin"
+#define PLAYLIST_UPLOAD_PATH "/playlist.tmp"
+#define PLAYLIST_PENDING_PATH "/playlist.new" // A validated upload waiting for loop() to swap it in
+#define PLAYLIST_MAGIC "FLPL"
+#define PLAYLIST_VERSION 1
+#define PLAYLIST_HEADER_SIZE 8        // Magic, version, reserved byte, number of entries
+#define PLAYLIST_ENTRY_HEADER_SIZE 7  // Dwell seconds, kind, alignment, rpm, payload length
+#define PLAYLIST_MAX_FILE_SIZE 262144
+#define PLAYLIST_ENTRY_MESSAGE 0
+#define PLAYLIST_ENTRY_FRAME 1
+#define PLAYLIST_ALIGNMENT_LEFT 0
+#define PLAYLIST_ALIGNMENT_CENTER 1
+#define PLAYLIST_ALIGNMENT_RIGHT 2
+#define PLAYLIST_FRAME_KEEP 0xFF      // Letter index of a frame that leaves the unit as is
+
+#define FRAME_LETTER_UNSENT 0xFF    // Letter index of a unit not composed or not sent yet
+#define FRAME_REFRESH_MILLIS 60000  // Period of sending every unit its letter again
+
+#define MAX_NUM_ZONES 8
+#define ZONE_MODE_SIZE 8
+#define ZONE_ALIGNMENT_SIZE 8
+#define ZONES_JSON_MAX_LENGTH 3800  // Below the limit of an NVS string
+
+#define FEED_TASK_STACK_SIZE 8192
+#define FEED_TASK_PRIORITY 1
+#define FEED_URL_MAX_LENGTH 256
+#define FEED_PATH_MAX_LENGTH 64
+#define FEED_PATH_MAX_SEGMENTS 8
+#define FEED_CONFIG_URL 0x01            // Flags of the fields a feed configuration command changes
+#define FEED_CONFIG_PATH 0x02
+#define FEED_CONFIG_INTERVAL 0x04
+#define FEED_CONFIG_PATH_OFFSET (FEED_URL_MAX_LENGTH + 1) // The path follows the URL in the text of the command
+#define FEED_KEY_SIZE 32              // Longer keys never match a path
+#define FEED_JSON_MAX_DEPTH 16        // Deeper documents are rejected
+#define FEED_READ_BUFFER_SIZE 128
+#define FEED_MAX_BODY_SIZE 65536      // Bytes read before giving up on finding the path
+#define FEED_HTTP_TIMEOUT_MILLIS 5000
+#define FEED_DEFAULT_INTERVAL_SEC 60
+#define FEED_MIN_INTERVAL_SEC 5
+#define FEED_MAX_INTERVAL_SEC 86400
+
+#define DISPLAY_MODE_SIZE 16
+#define DISPLAY_ALIGNMENT_SIZE 8
+#define DATE_TIME_STRING_SIZE 64     // Formatted date or clock, before alignment
+#define LOG_LINE_SIZE 256            // Longer log lines are truncated
+
+#define ALLOCATION_SOAK_WARMUP_TICKS 60 // Ticks after boot before SOAK_TEST builds require allocation-free ticks
+
+#define SERIAL_RX_BUFFER_SIZE (SERIAL_FRAME_HEADER_SIZE + SERIAL_FRAME_MAX_PAYLOAD + 1) // Room for a whole frame of the largest payload between two loop() iterations
+#define SERIAL_LINE_SIZE (MAX_NUM_UNITS + 16) // Longest console command
+#define SERIAL_FRAME_MAGIC 0xA5           // Starts a binary frame. Never part of a console command.
+#define SERIAL_FRAME_HEADER_SIZE 4        // Magic, type, payload length (little endian)
+#define SERIAL_FRAME_MAX_PAYLOAD (MAX_NUM_UNITS * 4)
+#define SERIAL_FRAME_TIMEOUT_MILLIS 200   // A frame whose bytes stop for this long is dropped. Also the quiet gap that ends a resync.
+#define SERIAL_FRAME_LETTERS 0x01         // Payload: rpm, then one letter index per unit from unit 0
+#define SERIAL_FRAME_UNITS 0x02           // Payload: 4 bytes per unit, i.e. unit address (little endian), letter index, rpm
+#define SERIAL_FRAME_ACK 0x80             // Added to the type of the frame acknowledged. Payload: status.
+#define SERIAL_FRAME_STATUS_OK 0
+#define SERIAL_FRAME_STATUS_BAD_CRC 1
+#define SERIAL_FRAME_STATUS_BAD_FRAME 2
+
+#define GROUP_ROLE_OFF 0
+#define GROUP_ROLE_COORDINATOR 1
+#define GROUP_ROLE_MEMBER 2
+#define GROUP_MULTICAST_ADDRESS "239.255.70.76"
+#define GROUP_PORT 4276
+#define GROUP_MAGIC "FLGR"
+#define GROUP_VERSION 1
+#define GROUP_HEADER_SIZE 28              // Magic, version, rpm, session, sequence, sent at, present at, start, count, total units
+#define GROUP_MAX_LETTERS_PER_PACKET 1024 // Keeps a packet within one Ethernet MTU
+#define GROUP_MAX_TOTAL_UNITS 4096
+#define GROUP_PRESENTATION_DELAY_MILLIS 200 // Time for a frame to reach every member before it is shown
+#define GROUP_LATE_TOLERANCE_MILLIS 20     // A frame presented later than this counts as late
+#define GROUP_CLOCK_SAMPLES 8              // Recent packets whose clock offsets are kept
+
 #define OPERATION_MODE_STA 0
 #define OPERATION_MODE_AP 1
 #define OPERATION_MODE_OFF 2
 
+#define WIFI_RECONNECT_MIN_BACKOFF_MILLIS 1000  // First wait before reconnecting a dropped STA link
+#define WIFI_RECONNECT_MAX_BACKOFF_MILLIS 60000 // Longest wait between two reconnection attempts
+
 
 #ifndef DATE_FORMAT
 #define DATE_FORMAT "D.M.d"
@@ -51,6 +223,17 @@
 #define PARAM_MAGNETIC_ZERO_POSITION_LETTER_INDEX "magneticZeroPositionLetterIndex"
 #define PARAM_NUM_I2C_BUS_STUCK "numI2CBusStuck"
 #define PARAM_LAST_I2C_BUS_STUCK_AT_MILLIS "lastI2CBusStuckAtMillis"
+#define PARAM_NUM_OFFLINE_UNITS "numOfflineUnits"
+#define PARAM_I2C_CLOCK "i2cClock"
+#define PARAM_UNITS_PER_SEGMENT "unitsPerSegment"
+#define PARAM_ZONES "zones"
+#define PARAM_FEED_URL "feedUrl"
+#define PARAM_FEED_PATH "feedPath"
+#define PARAM_FEED_INTERVAL_SEC "feedIntervalSec"
+#define PARAM_GROUP_ROLE "groupRole"
+#define PARAM_GROUP_TOTAL_UNITS "groupTotalUnits"
+#define PARAM_GROUP_UNIT_OFFSET "groupUnitOffset"
+#define PARAM_UNIT_PROTOCOL_V2 "unitProtocolV2"
 
 #define MORSE_CODE_UNIT_DURATION 250
 #define MORSE_CODE_WORD_SEPARATION_DURATION_FACTOR 7
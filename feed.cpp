@@ -0,0 +1,285 @@
+#include <WiFi.h>
+#include <HTTPClient.h>
+#include "feed.h"
+#include "jsonPath.h"
+#include "commandQueue.h"
+#include "nvsUtils.h"
+
+TaskHandle_t feedTaskHandle = NULL;
+
+/**
+ * @purpose Written by the feed task, read by GET /feed
+ */
+FeedStatus feedStatus = {0, 0, 0, 0, 0, ""};
+portMUX_TYPE feedStatusLock = portMUX_INITIALIZER_UNLOCKED;
+
+/**
+ * @purpose What the feed task fetches. Written by loop(), copied by the feed task at the start of every fetch, so that a URL is never paired with the path of another configuration.
+ */
+struct FeedConfig {
+    char url[FEED_URL_MAX_LENGTH + 1];
+    char path[FEED_PATH_MAX_LENGTH + 1];
+    int intervalSec;
+};
+FeedConfig feedConfig = {"", "", FEED_DEFAULT_INTERVAL_SEC};
+portMUX_TYPE feedConfigLock = portMUX_INITIALIZER_UNLOCKED;
+
+/**
+ * @purpose Validators of the last successful fetch, sent back so an unchanged document is not downloaded again. Feed task only.
+ */
+String feedETag;
+String feedLastModified;
+String fetchedUrl;
+String fetchedPath;
+
+/**
+ * @caller fetchFeed()
+ * @purpose Record the outcome of a request, and the value if one was found
+ */
+void recordFeedFetch(int statusCode, bool notModified, bool failed, const char *value)
+{
+  portENTER_CRITICAL(&feedStatusLock);
+  feedStatus.lastStatusCode = statusCode;
+  feedStatus.fetchedAtMillis = millis();
+  feedStatus.numFetches++;
+  if (notModified)
+  {
+    feedStatus.numNotModified++;
+  }
+  if (failed)
+  {
+    feedStatus.numErrors++;
+  }
+  if (value != NULL)
+  {
+    strncpy(feedStatus.value, value, MAX_NUM_UNITS);
+    feedStatus.value[MAX_NUM_UNITS] = '\0';
+  }
+  portEXIT_CRITICAL(&feedStatusLock);
+}
+
+/**
+ * @caller feedTask()
+ * @purpose Request the feed URL and pass the body through the path extractor as it arrives, so only a small buffer is held whatever the size of the document.
+ * A new value is handed over to loop().
+ */
+void fetchFeed(const String &url, const String &path)
+{
+  // Static to keep it off the feed task stack
+  static JsonPathExtractor extractor;
+  static char publishedValue[MAX_NUM_UNITS + 1] = "";
+
+  if (url != fetchedUrl || path != fetchedPath)
+  {
+    // The cached validators belong to another document or another value
+    feedETag = "";
+    feedLastModified = "";
+    fetchedUrl = url;
+    fetchedPath = path;
+  }
+  if (!extractor.begin(path.c_str()))
+  {
+    Serial.printf("Invalid feed path: %s\n", path.c_str());
+    recordFeedFetch(0, false, true, NULL);
+    return;
+  }
+
+  HTTPClient http;
+  http.setConnectTimeout(FEED_HTTP_TIMEOUT_MILLIS);
+  http.setTimeout(FEED_HTTP_TIMEOUT_MILLIS);
+  // Keep the server from sending a chunked body, which the stream would return with the chunk headers
+  http.useHTTP10(true);
+  if (!http.begin(url))
+  {
+    Serial.printf("Invalid feed URL: %s\n", url.c_str());
+    recordFeedFetch(0, false, true, NULL);
+    return;
+  }
+  const char *headerKeys[] = {"ETag", "Last-Modified"};
+  http.collectHeaders(headerKeys, 2);
+  if (feedETag.length() > 0)
+  {
+    http.addHeader("If-None-Match", feedETag);
+  }
+  if (feedLastModified.length() > 0)
+  {
+    http.addHeader("If-Modified-Since", feedLastModified);
+  }
+
+  int statusCode = http.GET();
+  if (statusCode == HTTP_CODE_NOT_MODIFIED)
+  {
+    http.end();
+    recordFeedFetch(statusCode, true, false, NULL);
+    return;
+  }
+  if (statusCode != HTTP_CODE_OK)
+  {
+    Serial.printf("Feed request failed: %d\n", statusCode);
+    http.end();
+    recordFeedFetch(statusCode, false, true, NULL);
+    return;
+  }
+
+  WiFiClient *stream = http.getStreamPtr();
+  int remaining = http.getSize(); // -1 if the server sent no Content-Length
+  int numRead = 0;
+  unsigned long lastReadAtMillis = millis();
+  uint8_t buffer[FEED_READ_BUFFER_SIZE];
+  while (!extractor.isDone() && !extractor.hasFailed() && remaining != 0 && numRead < FEED_MAX_BODY_SIZE)
+  {
+    size_t available = stream->available();
+    if (available == 0)
+    {
+      if (!http.connected() || millis() - lastReadAtMillis >= FEED_HTTP_TIMEOUT_MILLIS)
+      {
+        break;
+      }
+      vTaskDelay(1);
+      continue;
+    }
+    int length = stream->read(buffer, min(available, sizeof(buffer)));
+    if (length <= 0)
+    {
+      break;
+    }
+    for (int i = 0; i < length && !extractor.isDone(); i++)
+    {
+      extractor.feed((char)buffer[i]);
+    }
+    numRead += length;
+    if (remaining > 0)
+    {
+      remaining -= length;
+    }
+    lastReadAtMillis = millis();
+  }
+  // A number at the root only ends with the document
+  extractor.feed(' ');
+
+  if (!extractor.isDone())
+  {
+    Serial.printf("No value at %s in %d bytes of feed\n", path.c_str(), numRead);
+    // Download the document again next time rather than trusting a 304 for it
+    feedETag = "";
+    feedLastModified = "";
+    http.end();
+    recordFeedFetch(statusCode, false, true, NULL);
+    return;
+  }
+  feedETag = http.header("ETag");
+  feedLastModified = http.header("Last-Modified");
+  http.end();
+  recordFeedFetch(statusCode, false, false, extractor.getValue());
+
+  if (strcmp(extractor.getValue(), publishedValue) == 0)
+  {
+    return;
+  }
+  if (enqueueFeedCommand(makeTextCommand(LOOP_COMMAND_SET_FEED_VALUE, extractor.getValue())))
+  {
+    strcpy(publishedValue, extractor.getValue());
+  }
+}
+
+/**
+ * @caller startFeedTask()
+ * @purpose Fetch the feed every interval while in feed mode, or right away when requested
+ */
+void feedTask(void *parameter)
+{
+  // Static to keep it off the feed task stack
+  static FeedConfig config;
+  for (;;)
+  {
+    portENTER_CRITICAL(&feedConfigLock);
+    config = feedConfig;
+    portEXIT_CRITICAL(&feedConfigLock);
+    if (getNvsString(PARAM_MODE) == "feed" && config.url[0] != '\0' && WiFi.status() == WL_CONNECTED)
+    {
+      fetchFeed(config.url, config.path);
+    }
+    unsigned long intervalMillis = config.intervalSec * 1000UL;
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(intervalMillis));
+  }
+}
+
+/**
+ * @caller startFeedTask() and setFeedConfig()
+ * @purpose Publish a configuration to the feed task in one piece
+ */
+void publishFeedConfig(const String &url, const String &path, int intervalSec)
+{
+  portENTER_CRITICAL(&feedConfigLock);
+  strncpy(feedConfig.url, url.c_str(), FEED_URL_MAX_LENGTH);
+  feedConfig.url[FEED_URL_MAX_LENGTH] = '\0';
+  strncpy(feedConfig.path, path.c_str(), FEED_PATH_MAX_LENGTH);
+  feedConfig.path[FEED_PATH_MAX_LENGTH] = '\0';
+  feedConfig.intervalSec = intervalSec;
+  portEXIT_CRITICAL(&feedConfigLock);
+}
+
+/**
+ * @caller applyLoopCommand() in ESP.ino
+ * @purpose Store a validated configuration, then fetch with it right away. NULL fields and an interval of 0 are left as they are.
+ */
+void setFeedConfig(const char *url, const char *path, int intervalSec)
+{
+  if (url != NULL)
+  {
+    putNvsString(PARAM_FEED_URL, url);
+  }
+  if (path != NULL)
+  {
+    putNvsString(PARAM_FEED_PATH, path);
+  }
+  if (intervalSec != 0)
+  {
+    putNvsInt(PARAM_FEED_INTERVAL_SEC, intervalSec);
+  }
+  publishFeedConfig(getNvsString(PARAM_FEED_URL, ""), getNvsString(PARAM_FEED_PATH, ""), getNvsInt(PARAM_FEED_INTERVAL_SEC, FEED_DEFAULT_INTERVAL_SEC));
+  requestFeedFetch();
+}
+
+/**
+ * @caller setup() in ESP.ino
+ * @purpose Run the fetches on their own task, so a slow server never stalls loop() or the web server
+ */
+void startFeedTask()
+{
+  publishFeedConfig(getNvsString(PARAM_FEED_URL, ""), getNvsString(PARAM_FEED_PATH, ""), getNvsInt(PARAM_FEED_INTERVAL_SEC, FEED_DEFAULT_INTERVAL_SEC));
+  xTaskCreate(feedTask, "feed", FEED_TASK_STACK_SIZE, NULL, FEED_TASK_PRIORITY, &feedTaskHandle);
+}
+
+/**
+ * @caller setFeedConfig() and the mode command in ESP.ino
+ * @purpose Fetch now instead of at the end of the interval, e.g. after a configuration change
+ */
+void requestFeedFetch()
+{
+  if (feedTaskHandle != NULL)
+  {
+    xTaskNotifyGive(feedTaskHandle);
+  }
+}
+
+/**
+ * @caller POST /feed handler in ESP.ino
+ */
+bool isValidFeedPath(const char *path)
+{
+  // Static to keep it off the AsyncTCP task stack, which is the only caller
+  static JsonPathExtractor extractor;
+  return strlen(path) <= FEED_PATH_MAX_LENGTH && extractor.begin(path);
+}
+
+/**
+ * @caller GET /feed handler in ESP.ino
+ */
+FeedStatus getFeedStatus()
+{
+  portENTER_CRITICAL(&feedStatusLock);
+  FeedStatus status = feedStatus;
+  portEXIT_CRITICAL(&feedStatusLock);
+  return status;
+}
@@ -0,0 +1,22 @@
+#ifndef FEED_H
+#define FEED_H
+
+#include <Arduino.h>
+#include "env.h"
+
+struct FeedStatus {
+    int lastStatusCode;             // HTTP status, or a negative HTTPClient error. 0 before the first fetch.
+    unsigned long fetchedAtMillis;  // millis() of the last fetch
+    unsigned long numFetches;       // Requests sent since boot
+    unsigned long numNotModified;   // Requests answered 304 since boot
+    unsigned long numErrors;        // Requests that failed or whose body had no value at the path
+    char value[MAX_NUM_UNITS + 1];  // Last value found at the path
+};
+
+void startFeedTask();
+void setFeedConfig(const char *url, const char *path, int intervalSec);
+void requestFeedFetch();
+bool isValidFeedPath(const char *path);
+FeedStatus getFeedStatus();
+
+#endif // FEED_H
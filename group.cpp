@@ -0,0 +1,392 @@
+#include <lwip/sockets.h>
+#include <errno.h>
+#include <esp_random.h>
+#include "group.h"
+#include "FlapFunctions.h"
+#include "displaySettings.h"
+#include "nvsUtils.h"
+
+/**
+ * @purpose Group configuration and socket. loop() only.
+ */
+int groupRole = GROUP_ROLE_OFF;
+int groupTotalUnits = 0;
+int groupUnitOffset = 0;
+int groupSocket = -1;
+struct sockaddr_in groupAddress;
+
+/**
+ * @purpose The coordinator's rendering of the whole group wall, waiting to be multicast by pollGroup()
+ */
+uint8_t groupLetters[GROUP_MAX_TOTAL_UNITS];
+uint8_t groupRpm = 0;
+bool groupFrameReady = false;
+uint32_t groupSession = 0;  // Random per boot of the coordinator, so that members accept its sequence numbers starting over
+uint32_t groupSequence = 0;
+
+uint8_t groupPacket[GROUP_HEADER_SIZE + GROUP_MAX_LETTERS_PER_PACKET];
+
+/**
+ * @purpose This wall's slice of the latest frame, until its presentation time
+ */
+uint8_t pendingLetters[MAX_NUM_UNITS];
+uint8_t pendingRpm = 0;
+bool slicePending = false;
+uint32_t pendingSession = 0;
+uint32_t pendingSequence = 0;
+uint32_t pendingPresentAtMillis = 0; // Local clock
+uint32_t presentedSession = 0;
+uint32_t presentedSequence = 0;
+
+/**
+ * @purpose Recent offsets of the coordinator clock. Each is the true offset minus the delay of its packet, so the largest is the most accurate.
+ */
+int32_t clockOffsetSamples[GROUP_CLOCK_SAMPLES];
+int numClockOffsetSamples = 0;
+int nextClockOffsetSample = 0;
+
+/**
+ * @purpose Written by loop(), read by GET /group
+ */
+GroupStatus groupStatus = {GROUP_ROLE_OFF, 0, 0, 0, 0, 0, 0, 0, 0};
+portMUX_TYPE groupStatusLock = portMUX_INITIALIZER_UNLOCKED;
+
+const char *getGroupRoleName(int role)
+{
+  switch (role)
+  {
+  case GROUP_ROLE_COORDINATOR:
+    return "coordinator";
+  case GROUP_ROLE_MEMBER:
+    return "member";
+  default:
+    return "off";
+  }
+}
+
+/**
+ * @return GROUP_ROLE_*, or -1 if the name is unknown
+ */
+int parseGroupRole(const char *name)
+{
+  for (int role = GROUP_ROLE_OFF; role <= GROUP_ROLE_MEMBER; role++)
+  {
+    if (strcmp(name, getGroupRoleName(role)) == 0)
+    {
+      return role;
+    }
+  }
+  return -1;
+}
+
+int getGroupRole()
+{
+  return groupRole;
+}
+
+/**
+ * @caller loadGroupConfig()
+ * @purpose Open a non-blocking UDP socket. Members join the multicast group, the coordinator only sends to it.
+ */
+bool openGroupSocket()
+{
+  groupSocket = socket(AF_INET, SOCK_DGRAM, 0);
+  if (groupSocket < 0)
+  {
+    return false;
+  }
+  fcntl(groupSocket, F_SETFL, O_NONBLOCK);
+
+  memset(&groupAddress, 0, sizeof(groupAddress));
+  groupAddress.sin_family = AF_INET;
+  groupAddress.sin_port = htons(GROUP_PORT);
+  groupAddress.sin_addr.s_addr = inet_addr(GROUP_MULTICAST_ADDRESS);
+
+  if (groupRole == GROUP_ROLE_COORDINATOR)
+  {
+    uint8_t ttl = 1;
+    setsockopt(groupSocket, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+    return true;
+  }
+
+  // Several members may share a host when testing on loopback
+  int reuse = 1;
+  setsockopt(groupSocket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+  struct sockaddr_in bindAddress;
+  memset(&bindAddress, 0, sizeof(bindAddress));
+  bindAddress.sin_family = AF_INET;
+  bindAddress.sin_port = htons(GROUP_PORT);
+  bindAddress.sin_addr.s_addr = htonl(INADDR_ANY);
+  if (bind(groupSocket, (struct sockaddr *)&bindAddress, sizeof(bindAddress)) < 0)
+  {
+    return false;
+  }
+  struct ip_mreq membership;
+  membership.imr_multiaddr.s_addr = inet_addr(GROUP_MULTICAST_ADDRESS);
+  membership.imr_interface.s_addr = htonl(INADDR_ANY);
+  return setsockopt(groupSocket, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership)) == 0;
+}
+
+/**
+ * @caller setup() and the group command in ESP.ino
+ * @purpose Apply the group configuration stored in NVS. Call it once the network is up.
+ */
+void loadGroupConfig()
+{
+  if (groupSocket >= 0)
+  {
+    close(groupSocket);
+    groupSocket = -1;
+  }
+  groupRole = getNvsInt(PARAM_GROUP_ROLE, GROUP_ROLE_OFF);
+  groupTotalUnits = constrain(getNvsInt(PARAM_GROUP_TOTAL_UNITS, 0), 0, GROUP_MAX_TOTAL_UNITS);
+  groupUnitOffset = constrain(getNvsInt(PARAM_GROUP_UNIT_OFFSET, 0), 0, GROUP_MAX_TOTAL_UNITS);
+  groupFrameReady = false;
+  slicePending = false;
+  numClockOffsetSamples = 0;
+  nextClockOffsetSample = 0;
+  if (groupSession == 0)
+  {
+    groupSession = esp_random() | 1;
+  }
+
+  if (groupRole != GROUP_ROLE_OFF && !openGroupSocket())
+  {
+    Serial.printf("Failed to open the group socket, errno: %d\n", errno);
+    if (groupSocket >= 0)
+    {
+      close(groupSocket);
+      groupSocket = -1;
+    }
+    groupRole = GROUP_ROLE_OFF;
+  }
+  Serial.printf("Group role: %s, units %d-%d of %d\n", getGroupRoleName(groupRole), groupUnitOffset, groupUnitOffset + getDisplaySettings().numUnits - 1, groupTotalUnits);
+
+  portENTER_CRITICAL(&groupStatusLock);
+  groupStatus.role = groupRole;
+  groupStatus.totalUnits = groupTotalUnits;
+  groupStatus.unitOffset = groupUnitOffset;
+  groupStatus.clockOffsetMillis = 0;
+  portEXIT_CRITICAL(&groupStatusLock);
+}
+
+/**
+ * @caller renderDisplay() in ESP.ino
+ * @purpose Align a message to the whole group wall. pollGroup() multicasts it and shows this wall's slice at the same moment as the members.
+ */
+void showGroupMessage(const char *message, const char *alignment, int flapRpm)
+{
+  alignMessageLetters(groupLetters, groupTotalUnits, message, alignment);
+  groupRpm = flapRpm;
+  groupFrameReady = true;
+}
+
+/**
+ * @caller sendGroupFrame() and receiveGroupPackets()
+ * @purpose Keep the part of a frame slice that falls on this wall, to be presented at a time of the local clock
+ */
+void acceptGroupSlice(uint32_t session, uint32_t sequence, uint32_t presentAtMillis, uint8_t flapRpm, int start, int count, const uint8_t *letters)
+{
+  bool sameSession = session == presentedSession;
+  if (sameSession && (int32_t)(sequence - presentedSequence) <= 0)
+  {
+    // Already presented, e.g. a duplicate
+    return;
+  }
+  if (!slicePending || session != pendingSession || sequence != pendingSequence)
+  {
+    if (slicePending && session == pendingSession && (int32_t)(sequence - pendingSequence) < 0)
+    {
+      // Older than the frame being assembled
+      return;
+    }
+    memset(pendingLetters, FRAME_LETTER_UNSENT, sizeof(pendingLetters));
+    pendingSession = session;
+    pendingSequence = sequence;
+    pendingPresentAtMillis = presentAtMillis;
+    pendingRpm = flapRpm;
+    slicePending = true;
+  }
+
+  int numUnits = getDisplaySettings().numUnits;
+  int first = max(start, groupUnitOffset);
+  int last = min(start + count, groupUnitOffset + numUnits);
+  for (int i = first; i < last; i++)
+  {
+    pendingLetters[i - groupUnitOffset] = letters[i - start];
+  }
+}
+
+/**
+ * @caller pollGroup()
+ * @purpose Multicast the coordinator's frame in slices, all with the same presentation time, and accept this wall's slice directly
+ */
+void sendGroupFrame()
+{
+  groupFrameReady = false;
+  uint32_t sequence = ++groupSequence;
+  uint32_t presentAtMillis = millis() + GROUP_PRESENTATION_DELAY_MILLIS;
+  int numSent = 0;
+  for (int start = 0; start < groupTotalUnits; start += GROUP_MAX_LETTERS_PER_PACKET)
+  {
+    int count = min(groupTotalUnits - start, GROUP_MAX_LETTERS_PER_PACKET);
+    uint8_t *p = groupPacket;
+    memcpy(p, GROUP_MAGIC, 4);
+    p[4] = GROUP_VERSION;
+    p[5] = groupRpm;
+    uint32_t sentAtMillis = millis();
+    uint32_t fields[] = {groupSession, sequence, sentAtMillis, presentAtMillis};
+    for (int f = 0; f < 4; f++)
+    {
+      for (int b = 0; b < 4; b++)
+      {
+        p[6 + f * 4 + b] = (fields[f] >> (8 * b)) & 0xFF;
+      }
+    }
+    uint16_t shorts[] = {(uint16_t)start, (uint16_t)count, (uint16_t)groupTotalUnits};
+    for (int f = 0; f < 3; f++)
+    {
+      p[22 + f * 2] = shorts[f] & 0xFF;
+      p[23 + f * 2] = shorts[f] >> 8;
+    }
+    memcpy(p + GROUP_HEADER_SIZE, groupLetters + start, count);
+    if (sendto(groupSocket, groupPacket, GROUP_HEADER_SIZE + count, 0, (struct sockaddr *)&groupAddress, sizeof(groupAddress)) > 0)
+    {
+      numSent++;
+    }
+    acceptGroupSlice(groupSession, sequence, presentAtMillis, groupRpm, start, count, groupLetters + start);
+  }
+  portENTER_CRITICAL(&groupStatusLock);
+  groupStatus.numPacketsSent += numSent;
+  portEXIT_CRITICAL(&groupStatusLock);
+}
+
+uint32_t readGroupUint32(const uint8_t *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+uint16_t readGroupUint16(const uint8_t *p)
+{
+  return p[0] | (p[1] << 8);
+}
+
+/**
+ * @caller pollGroup()
+ * @purpose Drain the packets a member has received, updating the clock offset estimate with each
+ */
+void receiveGroupPackets()
+{
+  int length;
+  while ((length = recvfrom(groupSocket, groupPacket, sizeof(groupPacket), 0, NULL, NULL)) > 0)
+  {
+    uint32_t receivedAtMillis = millis();
+    if (length < GROUP_HEADER_SIZE || memcmp(groupPacket, GROUP_MAGIC, 4) != 0 || groupPacket[4] != GROUP_VERSION)
+    {
+      continue;
+    }
+    uint32_t session = readGroupUint32(groupPacket + 6);
+    uint32_t sequence = readGroupUint32(groupPacket + 10);
+    uint32_t sentAtMillis = readGroupUint32(groupPacket + 14);
+    uint32_t presentAtMillis = readGroupUint32(groupPacket + 18);
+    int start = readGroupUint16(groupPacket + 22);
+    int count = readGroupUint16(groupPacket + 24);
+    if (length != GROUP_HEADER_SIZE + count)
+    {
+      continue;
+    }
+
+    if (session != pendingSession && session != presentedSession)
+    {
+      // The coordinator has restarted, so its clock has too
+      numClockOffsetSamples = 0;
+      nextClockOffsetSample = 0;
+    }
+    clockOffsetSamples[nextClockOffsetSample] = (int32_t)(sentAtMillis - receivedAtMillis);
+    nextClockOffsetSample = (nextClockOffsetSample + 1) % GROUP_CLOCK_SAMPLES;
+    numClockOffsetSamples = min(numClockOffsetSamples + 1, GROUP_CLOCK_SAMPLES);
+    int32_t clockOffsetMillis = clockOffsetSamples[0];
+    for (int i = 1; i < numClockOffsetSamples; i++)
+    {
+      clockOffsetMillis = max(clockOffsetMillis, clockOffsetSamples[i]);
+    }
+
+    acceptGroupSlice(session, sequence, presentAtMillis - clockOffsetMillis, groupPacket[5], start, count, groupPacket + GROUP_HEADER_SIZE);
+
+    portENTER_CRITICAL(&groupStatusLock);
+    groupStatus.numPacketsReceived++;
+    groupStatus.clockOffsetMillis = clockOffsetMillis;
+    portEXIT_CRITICAL(&groupStatusLock);
+  }
+}
+
+/**
+ * @caller loop() in ESP.ino, on every iteration
+ * @purpose Send or receive group frames, and present the pending slice once its time has come.
+ * Runs outside of the counted tick, since the network stack allocates packet buffers.
+ */
+void pollGroup()
+{
+  if (groupRole == GROUP_ROLE_COORDINATOR && groupFrameReady)
+  {
+    sendGroupFrame();
+  }
+  else if (groupRole == GROUP_ROLE_MEMBER)
+  {
+    receiveGroupPackets();
+  }
+
+  int32_t lateMillis = (int32_t)(millis() - pendingPresentAtMillis);
+  if (!slicePending || lateMillis < 0)
+  {
+    return;
+  }
+  slicePending = false;
+  presentedSession = pendingSession;
+  presentedSequence = pendingSequence;
+  int globalRpm = getDisplaySettings().rpm;
+  int numUnits = getDisplaySettings().numUnits;
+  for (int i = 0; i < numUnits; i++)
+  {
+    setFrameUnit(i, pendingLetters[i], pendingRpm == 0 ? globalRpm : pendingRpm);
+  }
+  dispatchFrame();
+
+  portENTER_CRITICAL(&groupStatusLock);
+  groupStatus.numFramesPresented++;
+  if (lateMillis > GROUP_LATE_TOLERANCE_MILLIS)
+  {
+    groupStatus.numLateFrames++;
+  }
+  groupStatus.lastSequence = presentedSequence;
+  portEXIT_CRITICAL(&groupStatusLock);
+}
+
+/**
+ * @caller loop() in ESP.ino
+ * @purpose Shorten the sleep of loop() so that a composed frame is sent and a pending slice is presented on time
+ */
+unsigned long getGroupWaitMillis(unsigned long maxWaitMillis)
+{
+  if (groupFrameReady)
+  {
+    return 0;
+  }
+  if (!slicePending)
+  {
+    return maxWaitMillis;
+  }
+  int32_t untilPresentationMillis = (int32_t)(pendingPresentAtMillis - millis());
+  return untilPresentationMillis <= 0 ? 0 : min((unsigned long)untilPresentationMillis, maxWaitMillis);
+}
+
+/**
+ * @caller GET /group handler in ESP.ino
+ */
+GroupStatus getGroupStatus()
+{
+  portENTER_CRITICAL(&groupStatusLock);
+  GroupStatus status = groupStatus;
+  portEXIT_CRITICAL(&groupStatusLock);
+  return status;
+}
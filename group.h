@@ -0,0 +1,28 @@
+#ifndef GROUP_H
+#define GROUP_H
+
+#include <Arduino.h>
+#include "env.h"
+
+struct GroupStatus {
+    int role;                          // GROUP_ROLE_*
+    int totalUnits;                    // Units of the whole group wall
+    int unitOffset;                    // Position of this wall's unit 0 in the group wall
+    int32_t clockOffsetMillis;         // Coordinator clock minus local clock, as estimated by a member
+    unsigned long numPacketsSent;
+    unsigned long numPacketsReceived;
+    unsigned long numFramesPresented;
+    unsigned long numLateFrames;       // Frames presented more than GROUP_LATE_TOLERANCE_MILLIS after their time
+    unsigned long lastSequence;        // Sequence number of the last frame presented
+};
+
+void loadGroupConfig();
+int getGroupRole();
+const char *getGroupRoleName(int role);
+int parseGroupRole(const char *name);
+void showGroupMessage(const char *message, const char *alignment, int flapRpm);
+void pollGroup();
+unsigned long getGroupWaitMillis(unsigned long maxWaitMillis);
+GroupStatus getGroupStatus();
+
+#endif // GROUP_H
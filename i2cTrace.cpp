@@ -0,0 +1,351 @@
+#include "i2cTrace.h"
+
+volatile bool i2cTraceRecording = false;
+
+/**
+ * @purpose The ring buffer of transactions. Written by loop(), read by the export on the AsyncTCP task.
+ */
+I2CTraceRecord traceRecords[I2C_TRACE_SIZE];
+int nextTraceRecord = 0;
+I2CTraceStatus traceStatus = {I2C_TRACE_STATE_OFF, I2C_TRACE_TRIGGER_ERROR, 0, I2C_TRACE_SIZE / 2, 0, 0, 0};
+int postTriggerRecordsLeft = 0;
+portMUX_TYPE traceLock = portMUX_INITIALIZER_UNLOCKED;
+
+const char *getI2CTraceTriggerName(int trigger)
+{
+  switch (trigger)
+  {
+  case I2C_TRACE_TRIGGER_IMMEDIATE:
+    return "immediate";
+  case I2C_TRACE_TRIGGER_ERROR:
+    return "error";
+  case I2C_TRACE_TRIGGER_UNIT:
+    return "unit";
+  default:
+    return "";
+  }
+}
+
+/**
+ * @return I2C_TRACE_TRIGGER_*, or -1 if the name is unknown
+ */
+int parseI2CTraceTrigger(const char *name)
+{
+  for (int trigger = I2C_TRACE_TRIGGER_IMMEDIATE; trigger <= I2C_TRACE_TRIGGER_UNIT; trigger++)
+  {
+    if (strcmp(name, getI2CTraceTriggerName(trigger)) == 0)
+    {
+      return trigger;
+    }
+  }
+  return -1;
+}
+
+const char *getI2CTraceStateName(int state)
+{
+  switch (state)
+  {
+  case I2C_TRACE_STATE_ARMED:
+    return "armed";
+  case I2C_TRACE_STATE_TRIGGERED:
+    return "triggered";
+  case I2C_TRACE_STATE_DONE:
+    return "done";
+  default:
+    return "off";
+  }
+}
+
+const char *getI2CTraceKindName(int kind)
+{
+  switch (kind)
+  {
+  case I2C_TRACE_KIND_SHOW:
+    return "show";
+  case I2C_TRACE_KIND_UPDATE:
+    return "update";
+  case I2C_TRACE_KIND_FETCH:
+    return "fetch";
+  case I2C_TRACE_KIND_HELLO:
+    return "hello";
+  default:
+    return "recover";
+  }
+}
+
+/**
+ * @caller POST /i2c/trace handler in ESP.ino
+ * @purpose Clear the trace and record every transaction until postTriggerRecords transactions after the trigger
+ */
+void armI2CTrace(int trigger, int triggerUnitAddr, int postTriggerRecords)
+{
+  portENTER_CRITICAL(&traceLock);
+  nextTraceRecord = 0;
+  traceStatus.state = I2C_TRACE_STATE_ARMED;
+  traceStatus.trigger = trigger;
+  traceStatus.triggerUnitAddr = triggerUnitAddr;
+  traceStatus.postTriggerRecords = constrain(postTriggerRecords, 0, I2C_TRACE_SIZE - 1);
+  traceStatus.numRecords = 0;
+  traceStatus.armedAtMillis = millis();
+  traceStatus.triggeredAtMillis = 0;
+  i2cTraceRecording = true;
+  portEXIT_CRITICAL(&traceLock);
+}
+
+/**
+ * @caller POST /i2c/trace handler in ESP.ino
+ * @purpose Stop recording. The records are kept for export.
+ */
+void disarmI2CTrace()
+{
+  portENTER_CRITICAL(&traceLock);
+  i2cTraceRecording = false;
+  traceStatus.state = I2C_TRACE_STATE_OFF;
+  portEXIT_CRITICAL(&traceLock);
+}
+
+/**
+ * @caller traceI2C() in i2cTrace.h
+ * @purpose Add a transaction to the ring buffer and check the trigger
+ */
+void recordI2CTrace(uint32_t startMicros, int kind, int unitAddr, int busAddress, int command, const uint8_t *payload, int length, int result)
+{
+  uint32_t now = micros();
+  // Armed in the middle of the transaction
+  if (startMicros == 0)
+  {
+    startMicros = now;
+  }
+  length = constrain(length, 0, I2C_TRACE_PAYLOAD_SIZE);
+
+  portENTER_CRITICAL(&traceLock);
+  if (!i2cTraceRecording)
+  {
+    portEXIT_CRITICAL(&traceLock);
+    return;
+  }
+  I2CTraceRecord &record = traceRecords[nextTraceRecord];
+  nextTraceRecord = (nextTraceRecord + 1) % I2C_TRACE_SIZE;
+  traceStatus.numRecords = min(traceStatus.numRecords + 1, I2C_TRACE_SIZE);
+  record.atMicros = startMicros;
+  record.durationMicros = min(now - startMicros, (uint32_t)UINT16_MAX);
+  record.unitAddr = unitAddr;
+  record.kind = kind;
+  record.busAddress = busAddress;
+  record.command = command;
+  record.length = length;
+  if (length > 0)
+  {
+    memcpy(record.payload, payload, length);
+  }
+  record.result = result;
+  record.isTrigger = false;
+
+  if (traceStatus.state == I2C_TRACE_STATE_ARMED)
+  {
+    bool isTrigger = traceStatus.trigger == I2C_TRACE_TRIGGER_IMMEDIATE ||
+                     (traceStatus.trigger == I2C_TRACE_TRIGGER_ERROR && result != 0) ||
+                     (traceStatus.trigger == I2C_TRACE_TRIGGER_UNIT && unitAddr == traceStatus.triggerUnitAddr);
+    if (isTrigger)
+    {
+      record.isTrigger = true;
+      traceStatus.state = I2C_TRACE_STATE_TRIGGERED;
+      traceStatus.triggeredAtMillis = millis();
+      postTriggerRecordsLeft = traceStatus.postTriggerRecords;
+    }
+  }
+  else if (traceStatus.state == I2C_TRACE_STATE_TRIGGERED)
+  {
+    postTriggerRecordsLeft--;
+  }
+  if (traceStatus.state == I2C_TRACE_STATE_TRIGGERED && postTriggerRecordsLeft <= 0)
+  {
+    traceStatus.state = I2C_TRACE_STATE_DONE;
+    i2cTraceRecording = false;
+  }
+  portEXIT_CRITICAL(&traceLock);
+}
+
+/**
+ * @caller GET /i2c/trace handler in ESP.ino
+ */
+I2CTraceStatus getI2CTraceStatus()
+{
+  portENTER_CRITICAL(&traceLock);
+  I2CTraceStatus status = traceStatus;
+  portEXIT_CRITICAL(&traceLock);
+  return status;
+}
+
+/**
+ * @caller renderNextI2CTracePiece()
+ * @purpose Copy a record, the oldest being 0. Records of a trace that is still recording may move between two calls.
+ */
+I2CTraceRecord getI2CTraceRecord(int index)
+{
+  portENTER_CRITICAL(&traceLock);
+  int slot = (nextTraceRecord - traceStatus.numRecords + index + 2 * I2C_TRACE_SIZE) % I2C_TRACE_SIZE;
+  I2CTraceRecord record = traceRecords[slot];
+  portEXIT_CRITICAL(&traceLock);
+  return record;
+}
+
+/**
+ * @caller renderVcdRecord()
+ * @purpose Write a VCD vector value like "b00010100 #\n"
+ * @return The number of characters written
+ */
+int writeVcdVector(char *buffer, uint32_t value, int bits, char id)
+{
+  int length = 0;
+  buffer[length++] = 'b';
+  for (int bit = bits - 1; bit >= 0; bit--)
+  {
+    buffer[length++] = (value >> bit) & 1 ? '1' : '0';
+  }
+  buffer[length++] = ' ';
+  buffer[length++] = id;
+  buffer[length++] = '\n';
+  return length;
+}
+
+/**
+ * @caller renderVcdRecord()
+ * @purpose Write a timestamp relative to the first record, unless it is the current one. Time never goes back in a VCD.
+ */
+int writeVcdTime(char *buffer, I2CTraceCursor &cursor, uint32_t atMicros)
+{
+  uint32_t time = max(atMicros - cursor.baseMicros, cursor.lastTime);
+  if (time == cursor.lastTime)
+  {
+    return 0;
+  }
+  cursor.lastTime = time;
+  return sprintf(buffer, "#%lu\n", (unsigned long)time);
+}
+
+/**
+ * @caller renderNextI2CTracePiece()
+ * @purpose Render a transaction as value changes at its start and at its end
+ */
+int renderVcdRecord(I2CTraceCursor &cursor, const I2CTraceRecord &record)
+{
+  char *piece = cursor.piece;
+  int length = writeVcdTime(piece, cursor, record.atMicros);
+  length += sprintf(piece + length, "1!\n%c#\n", record.isTrigger ? '1' : '0');
+  length += writeVcdVector(piece + length, record.kind, 8, '$');
+  length += writeVcdVector(piece + length, (uint16_t)record.unitAddr, 16, '%');
+  length += writeVcdVector(piece + length, record.busAddress, 8, '&');
+  if (record.command == I2C_TRACE_NO_COMMAND)
+  {
+    length += sprintf(piece + length, "bx '\n");
+  }
+  else
+  {
+    length += writeVcdVector(piece + length, record.command, 8, '\'');
+  }
+  uint32_t payload = 0;
+  for (int i = 0; i < record.length; i++)
+  {
+    payload |= (uint32_t)record.payload[i] << (8 * (I2C_TRACE_PAYLOAD_SIZE - 1 - i));
+  }
+  length += writeVcdVector(piece + length, payload, 8 * I2C_TRACE_PAYLOAD_SIZE, '(');
+  length += writeVcdTime(piece + length, cursor, record.atMicros + max(record.durationMicros, (uint16_t)1));
+  length += sprintf(piece + length, "0!\n0#\n%c\"\n", record.result == 0 ? '0' : '1');
+  length += writeVcdVector(piece + length, record.result, 8, ')');
+  return length;
+}
+
+/**
+ * @caller serializeI2CTraceChunk()
+ * @purpose Render the next piece of the export into the cursor. Returns false when the export is complete.
+ */
+bool renderNextI2CTracePiece(I2CTraceCursor &cursor)
+{
+  char *piece = cursor.piece;
+  size_t size = sizeof(cursor.piece);
+  int length = 0;
+  if (cursor.nextRecord == -1)
+  {
+    cursor.numRecords = getI2CTraceStatus().numRecords;
+    cursor.baseMicros = cursor.numRecords > 0 ? getI2CTraceRecord(0).atMicros : 0;
+    cursor.lastTime = 0;
+    if (cursor.format == I2C_TRACE_FORMAT_VCD)
+    {
+      length = snprintf(piece, size,
+                        "$version %s $end\n$timescale 1us $end\n$scope module i2c $end\n"
+                        "$var wire 1 ! busy $end\n$var wire 1 \" error $end\n$var wire 1 # trigger $end\n"
+                        "$var wire 8 $ kind $end\n$var wire 16 %% unit $end\n$var wire 8 & address $end\n"
+                        "$var wire 8 ' command $end\n$var wire 32 ( payload $end\n$var wire 8 ) result $end\n"
+                        "$upscope $end\n$enddefinitions $end\n#0\n$dumpvars\n0!\n0\"\n0#\nb0 $\nb0 %%\nb0 &\nbx '\nb0 (\nb0 )\n$end\n",
+                        APP_NAME_SHORT);
+    }
+    else
+    {
+      length = snprintf(piece, size, "index,atMicros,durationMicros,kind,unitAddr,busAddress,command,payload,result,trigger\n");
+    }
+  }
+  else if (cursor.nextRecord < cursor.numRecords)
+  {
+    I2CTraceRecord record = getI2CTraceRecord(cursor.nextRecord);
+    if (cursor.format == I2C_TRACE_FORMAT_VCD)
+    {
+      length = renderVcdRecord(cursor, record);
+    }
+    else
+    {
+      char command[8] = "";
+      if (record.command != I2C_TRACE_NO_COMMAND)
+      {
+        snprintf(command, sizeof(command), "%d", record.command);
+      }
+      char payload[3 * I2C_TRACE_PAYLOAD_SIZE] = "";
+      int payloadLength = 0;
+      for (int i = 0; i < record.length; i++)
+      {
+        payloadLength += sprintf(payload + payloadLength, i == 0 ? "%02X" : " %02X", record.payload[i]);
+      }
+      length = snprintf(piece, size, "%d,%lu,%u,%s,%d,%d,%s,%s,%d,%d\n",
+                        cursor.nextRecord,
+                        (unsigned long)record.atMicros,
+                        record.durationMicros,
+                        getI2CTraceKindName(record.kind),
+                        record.unitAddr,
+                        record.busAddress,
+                        command,
+                        payload,
+                        record.result,
+                        record.isTrigger ? 1 : 0);
+    }
+  }
+  else
+  {
+    return false;
+  }
+  cursor.nextRecord++;
+  cursor.pieceLength = min((size_t)max(length, 0), size - 1);
+  cursor.pieceOffset = 0;
+  return true;
+}
+
+/**
+ * @caller GET /i2c/trace.csv and GET /i2c/trace.vcd handlers in ESP.ino
+ * @purpose Fill a chunked response buffer with the trace, one record at a time
+ * @return The number of bytes written. 0 when the export is complete.
+ */
+size_t serializeI2CTraceChunk(I2CTraceCursor &cursor, uint8_t *buffer, size_t maxLen)
+{
+  size_t written = 0;
+  while (written < maxLen)
+  {
+    if (cursor.pieceOffset >= cursor.pieceLength && !renderNextI2CTracePiece(cursor))
+    {
+      break;
+    }
+    size_t toCopy = min(cursor.pieceLength - cursor.pieceOffset, maxLen - written);
+    memcpy(buffer + written, cursor.piece + cursor.pieceOffset, toCopy);
+    cursor.pieceOffset += toCopy;
+    written += toCopy;
+  }
+  return written;
+}
@@ -0,0 +1,82 @@
+#ifndef I2CTRACE_H
+#define I2CTRACE_H
+
+#include <Arduino.h>
+#include "env.h"
+
+/**
+ * @purpose One bus transaction as captured by the trace
+ */
+struct I2CTraceRecord {
+    uint32_t atMicros;                       // micros() when the transaction started
+    uint16_t durationMicros;
+    int16_t unitAddr;                        // -1 for the whole bus
+    uint8_t kind;                            // I2C_TRACE_KIND_*
+    uint8_t busAddress;
+    uint8_t command;                         // I2C_TRACE_NO_COMMAND if none
+    uint8_t length;                          // Bytes of payload sent or received
+    uint8_t payload[I2C_TRACE_PAYLOAD_SIZE];
+    uint8_t result;                          // Wire.endTransmission() code or I2C_TRACE_RESULT_*
+    bool isTrigger;
+};
+
+struct I2CTraceStatus {
+    int state;                        // I2C_TRACE_STATE_*
+    int trigger;                      // I2C_TRACE_TRIGGER_*
+    int triggerUnitAddr;
+    int postTriggerRecords;           // Transactions recorded after the trigger
+    int numRecords;
+    unsigned long armedAtMillis;
+    unsigned long triggeredAtMillis;  // 0 if not triggered
+};
+
+/**
+ * @purpose Keep track of a chunked trace export between two chunks
+ */
+struct I2CTraceCursor {
+    int format = I2C_TRACE_FORMAT_CSV;
+    int nextRecord = -1;              // -1 before the header
+    int numRecords = 0;
+    uint32_t baseMicros = 0;          // Start of the first record, time 0 of a VCD
+    uint32_t lastTime = 0;            // Last VCD timestamp written, which must never go back
+    char piece[640];                  // Fits the VCD header
+    size_t pieceLength = 0;
+    size_t pieceOffset = 0;
+};
+
+/**
+ * @purpose Read by every traced transaction, so that a disarmed trace costs a load and a branch
+ */
+extern volatile bool i2cTraceRecording;
+
+void recordI2CTrace(uint32_t startMicros, int kind, int unitAddr, int busAddress, int command, const uint8_t *payload, int length, int result);
+
+/**
+ * @caller Traced transactions, before they start
+ * @return The start time to pass to traceI2C(), 0 while the trace is not recording
+ */
+inline uint32_t beginI2CTrace()
+{
+  return i2cTraceRecording ? micros() : 0;
+}
+
+/**
+ * @caller Traced transactions, once they are over
+ */
+inline void traceI2C(uint32_t startMicros, int kind, int unitAddr, int busAddress, int command, const uint8_t *payload, int length, int result)
+{
+  if (i2cTraceRecording)
+  {
+    recordI2CTrace(startMicros, kind, unitAddr, busAddress, command, payload, length, result);
+  }
+}
+
+void armI2CTrace(int trigger, int triggerUnitAddr, int postTriggerRecords);
+void disarmI2CTrace();
+int parseI2CTraceTrigger(const char *name);
+const char *getI2CTraceTriggerName(int trigger);
+const char *getI2CTraceStateName(int state);
+I2CTraceStatus getI2CTraceStatus();
+size_t serializeI2CTraceChunk(I2CTraceCursor &cursor, uint8_t *buffer, size_t maxLen);
+
+#endif // I2CTRACE_H
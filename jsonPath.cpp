@@ -0,0 +1,358 @@
+#include "jsonPath.h"
+
+/**
+ * @caller fetchFeed() in feed.cpp
+ * @purpose Parse a path like "departures[0].time" or "[2].name" and get ready for a new document. An empty path is the root value.
+ * @return false if the path is invalid
+ */
+bool JsonPathExtractor::begin(const char *path)
+{
+  numSegments = 0;
+  depth = 0;
+  state = STATE_VALUE;
+  escaped = false;
+  unicodeDigitsLeft = 0;
+  capturing = false;
+  valueLength = 0;
+  value[0] = '\0';
+
+  const char *c = path;
+  while (*c != '\0')
+  {
+    if (numSegments == FEED_PATH_MAX_SEGMENTS)
+    {
+      state = STATE_FAILED;
+      return false;
+    }
+    JsonPathSegment &segment = segments[numSegments++];
+    if (*c == '[')
+    {
+      c++;
+      if (!isdigit(*c))
+      {
+        state = STATE_FAILED;
+        return false;
+      }
+      segment.key[0] = '\0';
+      segment.index = 0;
+      while (isdigit(*c) && segment.index <= 65535)
+      {
+        segment.index = segment.index * 10 + (*c++ - '0');
+      }
+      if (*c++ != ']' || (*c != '\0' && *c != '.' && *c != '['))
+      {
+        state = STATE_FAILED;
+        return false;
+      }
+    }
+    else
+    {
+      size_t length = 0;
+      while (*c != '\0' && *c != '.' && *c != '[')
+      {
+        if (length == FEED_KEY_SIZE - 1)
+        {
+          state = STATE_FAILED;
+          return false;
+        }
+        segment.key[length++] = *c++;
+      }
+      if (length == 0)
+      {
+        state = STATE_FAILED;
+        return false;
+      }
+      segment.key[length] = '\0';
+      segment.index = -1;
+    }
+    if (*c == '.')
+    {
+      c++;
+      if (*c == '\0' || *c == '[')
+      {
+        state = STATE_FAILED;
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+/**
+ * @caller fetchFeed() in feed.cpp
+ * @purpose Advance the parser by one character of the document. Nothing happens once it is done or has failed.
+ */
+void JsonPathExtractor::feed(char c)
+{
+  bool isWhitespace = c == ' ' || c == '\t' || c == '\r' || c == '\n';
+  switch (state)
+  {
+  case STATE_VALUE:
+    if (!isWhitespace)
+    {
+      beginValue(c);
+    }
+    return;
+  case STATE_KEY_OR_END:
+    if (isWhitespace)
+    {
+      return;
+    }
+    if (c == '"')
+    {
+      state = STATE_KEY;
+      keyLength = 0;
+      keyOverflow = false;
+    }
+    else if (c == '}')
+    {
+      endContainer(c);
+    }
+    else
+    {
+      state = STATE_FAILED;
+    }
+    return;
+  case STATE_KEY:
+  case STATE_STRING:
+  {
+    char decoded = c;
+    if (unicodeDigitsLeft > 0)
+    {
+      // The display has no letters beyond ASCII, so a \uXXXX escape is shown as '?'
+      if (--unicodeDigitsLeft > 0)
+      {
+        return;
+      }
+      decoded = '?';
+    }
+    else if (escaped)
+    {
+      escaped = false;
+      if (c == 'u')
+      {
+        unicodeDigitsLeft = 4;
+        return;
+      }
+      if (c == 'n' || c == 'r' || c == 't')
+      {
+        decoded = ' ';
+      }
+      else if (c == 'b' || c == 'f')
+      {
+        return;
+      }
+    }
+    else if (c == '\\')
+    {
+      escaped = true;
+      return;
+    }
+    else if (c == '"')
+    {
+      if (state == STATE_STRING)
+      {
+        endValue();
+        return;
+      }
+      Container &container = containers[depth - 1];
+      // A truncated key must not match a path key that happens to be its prefix
+      container.key[keyOverflow ? 0 : keyLength] = '\0';
+      updateMatch();
+      state = STATE_COLON;
+      return;
+    }
+
+    if (state == STATE_STRING)
+    {
+      appendValue(decoded);
+    }
+    else if (keyLength < FEED_KEY_SIZE - 1)
+    {
+      containers[depth - 1].key[keyLength++] = decoded;
+    }
+    else
+    {
+      keyOverflow = true;
+    }
+    return;
+  }
+  case STATE_COLON:
+    if (c == ':')
+    {
+      state = STATE_VALUE;
+    }
+    else if (!isWhitespace)
+    {
+      state = STATE_FAILED;
+    }
+    return;
+  case STATE_LITERAL:
+    if (isWhitespace || c == ',' || c == '}' || c == ']')
+    {
+      endValue();
+      feed(c);
+    }
+    else
+    {
+      appendValue(c);
+    }
+    return;
+  case STATE_AFTER_VALUE:
+    if (isWhitespace)
+    {
+      return;
+    }
+    if (c == ',')
+    {
+      Container &container = containers[depth - 1];
+      if (container.isArray)
+      {
+        container.index++;
+        updateMatch();
+        state = STATE_VALUE;
+      }
+      else
+      {
+        state = STATE_KEY_OR_END;
+      }
+    }
+    else if (c == '}' || c == ']')
+    {
+      endContainer(c);
+    }
+    else
+    {
+      state = STATE_FAILED;
+    }
+    return;
+  case STATE_DONE:
+  case STATE_FAILED:
+    return;
+  }
+}
+
+/**
+ * @caller feed()
+ * @purpose Start parsing a value with its first character
+ */
+void JsonPathExtractor::beginValue(char c)
+{
+  capturing = isTargetDepth();
+  valueLength = 0;
+  if (c == '{' || c == '[')
+  {
+    // Only scalars can be shown, and containers deeper than the limit are not tracked
+    if (capturing || depth == FEED_JSON_MAX_DEPTH)
+    {
+      state = STATE_FAILED;
+      return;
+    }
+    Container &container = containers[depth++];
+    container.isArray = c == '[';
+    container.index = 0;
+    container.key[0] = '\0';
+    container.matches = false;
+    if (container.isArray)
+    {
+      updateMatch();
+      state = STATE_VALUE;
+    }
+    else
+    {
+      state = STATE_KEY_OR_END;
+    }
+  }
+  else if (c == ']' && depth > 0 && containers[depth - 1].isArray)
+  {
+    // Empty array
+    endContainer(c);
+  }
+  else if (c == '"')
+  {
+    state = STATE_STRING;
+  }
+  else if (c == '-' || isalnum(c))
+  {
+    state = STATE_LITERAL;
+    appendValue(c);
+  }
+  else
+  {
+    state = STATE_FAILED;
+  }
+}
+
+/**
+ * @caller feed()
+ * @purpose Finish a scalar. The search is over if it was the value at the path or the whole document.
+ */
+void JsonPathExtractor::endValue()
+{
+  if (capturing)
+  {
+    value[valueLength] = '\0';
+    state = STATE_DONE;
+  }
+  else
+  {
+    state = depth == 0 ? STATE_FAILED : STATE_AFTER_VALUE;
+  }
+}
+
+/**
+ * @caller feed() and beginValue()
+ * @purpose Close the innermost container. The path is not in the document if it was the root.
+ */
+void JsonPathExtractor::endContainer(char c)
+{
+  if ((c == ']') != containers[depth - 1].isArray)
+  {
+    state = STATE_FAILED;
+    return;
+  }
+  depth--;
+  state = depth == 0 ? STATE_FAILED : STATE_AFTER_VALUE;
+}
+
+/**
+ * @caller feed() and beginValue()
+ * @purpose Check whether the current member of the innermost container is on the path
+ */
+void JsonPathExtractor::updateMatch()
+{
+  int level = depth - 1;
+  Container &container = containers[level];
+  bool enclosingMatches = level == 0 || containers[level - 1].matches;
+  if (level >= numSegments || !enclosingMatches)
+  {
+    container.matches = false;
+    return;
+  }
+  const JsonPathSegment &segment = segments[level];
+  if (container.isArray)
+  {
+    container.matches = segment.key[0] == '\0' && segment.index == container.index;
+  }
+  else
+  {
+    container.matches = segment.key[0] != '\0' && strcmp(segment.key, container.key) == 0;
+  }
+}
+
+bool JsonPathExtractor::isTargetDepth() const
+{
+  return depth == numSegments && (depth == 0 || containers[depth - 1].matches);
+}
+
+/**
+ * @caller feed() and beginValue()
+ * @purpose Keep a character of the value at the path. Values longer than the wall are truncated.
+ */
+void JsonPathExtractor::appendValue(char c)
+{
+  if (capturing && valueLength < MAX_NUM_UNITS)
+  {
+    value[valueLength++] = c;
+  }
+}
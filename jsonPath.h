@@ -0,0 +1,68 @@
+#ifndef JSONPATH_H
+#define JSONPATH_H
+
+#include <Arduino.h>
+#include "env.h"
+
+/**
+ * @purpose One step of a path: a member key, or an array index if key is empty
+ */
+struct JsonPathSegment {
+    char key[FEED_KEY_SIZE];
+    int index;
+};
+
+/**
+ * @purpose Find the scalar value at a path like "departures[0].time" in a JSON document fed one character at a time.
+ * Only the current key of each open container is kept, so the memory is bounded whatever the size of the document.
+ */
+class JsonPathExtractor {
+public:
+    bool begin(const char *path);
+    void feed(char c);
+    bool isDone() const { return state == STATE_DONE; }
+    bool hasFailed() const { return state == STATE_FAILED; }
+    const char *getValue() const { return value; }
+
+private:
+    enum State {
+        STATE_VALUE,           // Expecting a value
+        STATE_KEY_OR_END,      // After '{' or ','
+        STATE_KEY,             // Inside a member key
+        STATE_COLON,           // After a member key
+        STATE_STRING,          // Inside a string value
+        STATE_LITERAL,         // Inside a number, true, false or null
+        STATE_AFTER_VALUE,     // Expecting ',' or the end of the container
+        STATE_DONE,
+        STATE_FAILED,
+    };
+
+    struct Container {
+        bool isArray;
+        int index;
+        char key[FEED_KEY_SIZE];
+        bool matches;          // The current member and all the enclosing ones are on the path
+    };
+
+    JsonPathSegment segments[FEED_PATH_MAX_SEGMENTS];
+    int numSegments = 0;
+    Container containers[FEED_JSON_MAX_DEPTH];
+    int depth = 0;
+    State state = STATE_VALUE;
+    bool escaped = false;
+    int unicodeDigitsLeft = 0;
+    bool capturing = false;    // The value being parsed is the one at the path
+    size_t keyLength = 0;
+    bool keyOverflow = false;
+    char value[MAX_NUM_UNITS + 1];
+    size_t valueLength = 0;
+
+    void beginValue(char c);
+    void endValue();
+    void endContainer(char c);
+    void updateMatch();
+    bool isTargetDepth() const;
+    void appendValue(char c);
+};
+
+#endif // JSONPATH_H
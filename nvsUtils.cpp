@@ -1,8 +1,10 @@
 #include "nvsUtils.h"
-#include "prefs.h"
+#include <Preferences.h>
 #include "env.h"
 
+// Each call opens its own Preferences handle, so that loop() and the web API handlers never share one
 String getNvsString(String key, String defaultValue) {
+    Preferences prefs;
     prefs.begin(APP_NAME_SHORT, true);
     String value = prefs.getString(key.c_str(), defaultValue.c_str());
     prefs.end();
@@ -14,12 +16,14 @@ String getNvsString(String key) {
 }
 
 void putNvsString(String key, String value) {
+    Preferences prefs;
     prefs.begin(APP_NAME_SHORT, false);
     prefs.putString(key.c_str(), value.c_str());
     prefs.end();
 }
 
 int getNvsInt(String key, int defaultValue) {
+    Preferences prefs;
     prefs.begin(APP_NAME_SHORT, true);
     int value = prefs.getInt(key.c_str(), defaultValue);
     prefs.end();
@@ -31,6 +35,7 @@ int getNvsInt(String key) {
 }
 
 void putNvsInt(String key, int value) {
+    Preferences prefs;
     prefs.begin(APP_NAME_SHORT, false);
     prefs.putInt(key.c_str(), value);
     prefs.end();
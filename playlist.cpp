@@ -0,0 +1,363 @@
+#include "playlist.h"
+#include "FlapFunctions.h"
+#include "nvsUtils.h"
+#include "displaySettings.h"
+#include "letters.h"
+
+/**
+ * @purpose The file being uploaded. Web API handlers only.
+ */
+File playlistUploadFile;
+bool playlistUploadFailed = false;
+
+/**
+ * @purpose Playback state. loop() only.
+ * The entry on the display is kept in RAM, and only the offset of the next one is remembered, so that the file is read one entry at a time however long it is.
+ */
+PlaylistEntry currentPlaylistEntry;
+int currentPlaylistEntryIndex = -1;
+uint32_t nextPlaylistEntryOffset = PLAYLIST_HEADER_SIZE;
+unsigned long currentPlaylistEntryShownAtMillis = 0;
+bool playlistRestartRequested = true;
+
+/**
+ * @caller readPlaylistHeader() and readPlaylistEntry()
+ * @purpose Read a little-endian 16-bit integer
+ */
+uint16_t readUint16(const uint8_t *bytes)
+{
+  return bytes[0] | (bytes[1] << 8);
+}
+
+/**
+ * @caller Playback, listing and upload validation
+ * @purpose Read and check the file header
+ * @return Number of entries, or -1 if the header is invalid
+ */
+int readPlaylistHeader(File &file)
+{
+  uint8_t header[PLAYLIST_HEADER_SIZE];
+  if (!file.seek(0) || file.read(header, PLAYLIST_HEADER_SIZE) != PLAYLIST_HEADER_SIZE)
+  {
+    return -1;
+  }
+  if (memcmp(header, PLAYLIST_MAGIC, 4) != 0 || header[4] != PLAYLIST_VERSION)
+  {
+    return -1;
+  }
+  return readUint16(header + 6);
+}
+
+/**
+ * @caller Playback, listing and upload validation
+ * @purpose Read and check the entry at the current file position. The payload is read only if readPayload is set.
+ */
+bool readPlaylistEntry(File &file, PlaylistEntry &entry, bool readPayload)
+{
+  uint8_t entryHeader[PLAYLIST_ENTRY_HEADER_SIZE];
+  if (file.read(entryHeader, PLAYLIST_ENTRY_HEADER_SIZE) != PLAYLIST_ENTRY_HEADER_SIZE)
+  {
+    return false;
+  }
+  entry.dwellSeconds = readUint16(entryHeader);
+  entry.kind = entryHeader[2];
+  entry.alignment = entryHeader[3];
+  entry.rpm = entryHeader[4];
+  entry.length = readUint16(entryHeader + 5);
+  if (entry.kind > PLAYLIST_ENTRY_FRAME || entry.alignment > PLAYLIST_ALIGNMENT_RIGHT || entry.length > MAX_NUM_UNITS)
+  {
+    return false;
+  }
+  if (!readPayload)
+  {
+    return file.seek(entry.length, fs::SeekCur);
+  }
+  if (file.read(entry.payload, entry.length) != entry.length)
+  {
+    return false;
+  }
+  entry.payload[entry.length] = '\0';
+  if (entry.kind == PLAYLIST_ENTRY_FRAME)
+  {
+    for (int i = 0; i < entry.length; i++)
+    {
+      if (entry.payload[i] >= NUM_FLAPS && entry.payload[i] != PLAYLIST_FRAME_KEEP)
+      {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+/**
+ * @caller POST /playlist handler in ESP.ino, on the first chunk
+ * @purpose Start writing an upload to a temporary file, so that a failed upload leaves the active playlist alone
+ */
+bool beginPlaylistUpload(size_t total)
+{
+  if (playlistUploadFile)
+  {
+    playlistUploadFile.close();
+  }
+  playlistUploadFailed = total > PLAYLIST_MAX_FILE_SIZE;
+  if (playlistUploadFailed)
+  {
+    Serial.printf("Playlist of %u bytes is too large\n", (unsigned)total);
+    return false;
+  }
+  playlistUploadFile = LittleFS.open(PLAYLIST_UPLOAD_PATH, "w");
+  playlistUploadFailed = !playlistUploadFile;
+  return !playlistUploadFailed;
+}
+
+/**
+ * @caller POST /playlist handler in ESP.ino, on every chunk
+ */
+bool writePlaylistUploadChunk(const uint8_t *data, size_t len)
+{
+  if (playlistUploadFailed || !playlistUploadFile)
+  {
+    return false;
+  }
+  playlistUploadFailed = playlistUploadFile.write(data, len) != len;
+  return !playlistUploadFailed;
+}
+
+/**
+ * @caller POST /playlist handler in ESP.ino, on the last chunk
+ * @purpose Validate the uploaded file entry by entry and hand it over to loop(), which reads the active playlist and so is the one to replace it
+ * @return Number of entries, or -1 if the upload is invalid
+ */
+int finishPlaylistUpload()
+{
+  if (playlistUploadFile)
+  {
+    playlistUploadFile.close();
+  }
+  if (playlistUploadFailed)
+  {
+    LittleFS.remove(PLAYLIST_UPLOAD_PATH);
+    return -1;
+  }
+
+  File file = LittleFS.open(PLAYLIST_UPLOAD_PATH, "r");
+  int numEntries = file ? readPlaylistHeader(file) : -1;
+  static PlaylistEntry entry;
+  for (int i = 0; i < numEntries; i++)
+  {
+    if (!readPlaylistEntry(file, entry, true))
+    {
+      Serial.printf("Playlist entry %d is invalid\n", i);
+      numEntries = -1;
+    }
+  }
+  bool trailingBytes = file && file.available() > 0;
+  file.close();
+
+  if (numEntries < 0 || trailingBytes)
+  {
+    LittleFS.remove(PLAYLIST_UPLOAD_PATH);
+    return -1;
+  }
+  // An upload still pending is replaced, and the command of this upload activates the newer file
+  LittleFS.remove(PLAYLIST_PENDING_PATH);
+  if (!LittleFS.rename(PLAYLIST_UPLOAD_PATH, PLAYLIST_PENDING_PATH))
+  {
+    return -1;
+  }
+  Serial.printf("Playlist with %d entries uploaded\n", numEntries);
+  return numEntries;
+}
+
+/**
+ * @caller applyLoopCommand() in ESP.ino
+ * @purpose Make the pending upload the active playlist. Nothing to do if an earlier command already activated it.
+ */
+void activatePendingPlaylist()
+{
+  if (!LittleFS.exists(PLAYLIST_PENDING_PATH))
+  {
+    return;
+  }
+  LittleFS.remove(PLAYLIST_PATH);
+  if (!LittleFS.rename(PLAYLIST_PENDING_PATH, PLAYLIST_PATH))
+  {
+    Serial.println("Failed to activate the uploaded playlist");
+  }
+}
+
+/**
+ * @caller Playlist commands in ESP.ino
+ * @purpose Start the playlist over from the given entry on the next render
+ */
+void restartPlaylist(int entryIndex)
+{
+  currentPlaylistEntryIndex = max(entryIndex, 0) - 1;
+  playlistRestartRequested = true;
+}
+
+/**
+ * @caller showPlaylist()
+ * @purpose Load the entry after the current one into RAM, wrapping around at the end of the file
+ */
+bool advancePlaylist()
+{
+  File file = LittleFS.open(PLAYLIST_PATH, "r");
+  if (!file)
+  {
+    return false;
+  }
+  int numEntries = readPlaylistHeader(file);
+  if (numEntries <= 0)
+  {
+    file.close();
+    return false;
+  }
+
+  int entryIndex = currentPlaylistEntryIndex + 1;
+  if (playlistRestartRequested || entryIndex >= numEntries)
+  {
+    // Walk from the first entry, skipping payloads, to find the entry to show
+    entryIndex = entryIndex >= numEntries ? 0 : entryIndex;
+    nextPlaylistEntryOffset = PLAYLIST_HEADER_SIZE;
+    file.seek(nextPlaylistEntryOffset);
+    for (int i = 0; i < entryIndex; i++)
+    {
+      if (!readPlaylistEntry(file, currentPlaylistEntry, false))
+      {
+        file.close();
+        return false;
+      }
+    }
+    nextPlaylistEntryOffset = file.position();
+  }
+
+  bool success = file.seek(nextPlaylistEntryOffset) && readPlaylistEntry(file, currentPlaylistEntry, true);
+  if (success)
+  {
+    nextPlaylistEntryOffset = file.position();
+    currentPlaylistEntryIndex = entryIndex;
+    currentPlaylistEntryShownAtMillis = millis();
+    playlistRestartRequested = false;
+  }
+  file.close();
+  return success;
+}
+
+/**
+ * @caller renderDisplay() in ESP.ino
+ * @purpose Show the current playlist entry, moving on to the next one when its dwell time is over
+ */
+void showPlaylist()
+{
+  bool dwellOver = millis() - currentPlaylistEntryShownAtMillis >= (unsigned long)currentPlaylistEntry.dwellSeconds * 1000;
+  if ((playlistRestartRequested || dwellOver) && !advancePlaylist())
+  {
+    Serial.println("No playable playlist");
+    return;
+  }
+
+  PlaylistEntry &entry = currentPlaylistEntry;
+  int flapRpm = entry.rpm == 0 ? getDisplaySettings().rpm : entry.rpm;
+  Serial.printf("Playlist entry %d, kind: %d, dwell: %ds\n", currentPlaylistEntryIndex, entry.kind, entry.dwellSeconds);
+  if (entry.kind == PLAYLIST_ENTRY_MESSAGE)
+  {
+    const char *alignments[] = {"left", "center", "right"};
+    showAlignedMessage((const char *)entry.payload, alignments[entry.alignment], flapRpm);
+  }
+  else
+  {
+    showFrame(entry.payload, entry.length, flapRpm);
+  }
+}
+
+/**
+ * @caller GET /playlist handler in ESP.ino
+ */
+int getPlaylistEntryIndex()
+{
+  return currentPlaylistEntryIndex;
+}
+
+/**
+ * @caller serializePlaylistChunk()
+ * @purpose Render the next piece of the playlist listing into the cursor. Returns false when the document is complete.
+ */
+bool renderNextPlaylistPiece(PlaylistCursor &cursor)
+{
+  char *piece = cursor.piece;
+  size_t size = sizeof(cursor.piece);
+  int length = 0;
+  if (cursor.nextEntry == -1)
+  {
+    cursor.file = LittleFS.open(PLAYLIST_PATH, "r");
+    cursor.numEntries = cursor.file ? max(readPlaylistHeader(cursor.file), 0) : 0;
+    length = snprintf(piece, size, "{\"currentEntry\":%d,\"entries\":[", getPlaylistEntryIndex());
+  }
+  else if (cursor.nextEntry < cursor.numEntries)
+  {
+    PlaylistEntry &entry = cursor.entry;
+    if (!readPlaylistEntry(cursor.file, entry, true))
+    {
+      // The file changed under the listing. Close the document early.
+      cursor.numEntries = cursor.nextEntry;
+      return renderNextPlaylistPiece(cursor);
+    }
+    const char *alignments[] = {"left", "center", "right"};
+    length = snprintf(piece, size,
+                      "%s{\"index\":%d,\"kind\":\"%s\",\"dwellSeconds\":%d,\"alignment\":\"%s\",\"rpm\":%d,\"%s\":\"",
+                      cursor.nextEntry == 0 ? "" : ",",
+                      cursor.nextEntry,
+                      entry.kind == PLAYLIST_ENTRY_MESSAGE ? "message" : "frame",
+                      entry.dwellSeconds,
+                      alignments[entry.alignment],
+                      entry.rpm,
+                      entry.kind == PLAYLIST_ENTRY_MESSAGE ? "text" : "letters");
+    for (int i = 0; i < entry.length && length < (int)size - 3; i++)
+    {
+      char c = entry.kind == PLAYLIST_ENTRY_MESSAGE ? entry.payload[i] : (entry.payload[i] == PLAYLIST_FRAME_KEEP ? '_' : translateIndextoLetter(entry.payload[i]));
+      if (c == '"' || c == '\\')
+      {
+        piece[length++] = '\\';
+      }
+      piece[length++] = (c < 0x20 || c > 0x7E) ? '?' : c;
+    }
+    length += snprintf(piece + length, size - length, "\"}");
+  }
+  else if (cursor.nextEntry == cursor.numEntries)
+  {
+    cursor.file.close();
+    length = snprintf(piece, size, "]}");
+  }
+  else
+  {
+    return false;
+  }
+  cursor.nextEntry++;
+  cursor.pieceLength = min((size_t)max(length, 0), size - 1);
+  cursor.pieceOffset = 0;
+  return true;
+}
+
+/**
+ * @caller GET /playlist handler in ESP.ino
+ * @purpose Fill a chunked response buffer with the playlist listing, reading the file one entry at a time
+ * @return The number of bytes written. 0 when the document is complete.
+ */
+size_t serializePlaylistChunk(PlaylistCursor &cursor, uint8_t *buffer, size_t maxLen)
+{
+  size_t written = 0;
+  while (written < maxLen)
+  {
+    if (cursor.pieceOffset >= cursor.pieceLength && !renderNextPlaylistPiece(cursor))
+    {
+      break;
+    }
+    size_t toCopy = min(cursor.pieceLength - cursor.pieceOffset, maxLen - written);
+    memcpy(buffer + written, cursor.piece + cursor.pieceOffset, toCopy);
+    cursor.pieceOffset += toCopy;
+    written += toCopy;
+  }
+  return written;
+}
@@ -0,0 +1,42 @@
+#ifndef PLAYLIST_H
+#define PLAYLIST_H
+
+#include <Arduino.h>
+#include "LittleFS.h"
+#include "env.h"
+
+/**
+ * @purpose One playlist entry as stored in the playlist file, with its payload
+ */
+struct PlaylistEntry {
+    uint16_t dwellSeconds;             // How long the entry stays on the display
+    uint8_t kind;                      // PLAYLIST_ENTRY_MESSAGE or PLAYLIST_ENTRY_FRAME
+    uint8_t alignment;                 // PLAYLIST_ALIGNMENT_*, messages only
+    uint8_t rpm;                       // 0 means the global rpm
+    uint16_t length;                   // Bytes of payload
+    uint8_t payload[MAX_NUM_UNITS + 1]; // Message characters, or one letter index per unit (PLAYLIST_FRAME_KEEP leaves a unit as is). Messages are NUL-terminated.
+};
+
+/**
+ * @purpose Keep track of a chunked playlist listing between two chunks
+ */
+struct PlaylistCursor {
+    File file;
+    int nextEntry = -1;     // -1 before the opening of the document
+    int numEntries = 0;
+    PlaylistEntry entry;
+    char piece[2 * MAX_NUM_UNITS + 160]; // Worst case of an escaped entry
+    size_t pieceLength = 0;
+    size_t pieceOffset = 0;
+};
+
+bool beginPlaylistUpload(size_t total);
+bool writePlaylistUploadChunk(const uint8_t *data, size_t len);
+int finishPlaylistUpload();
+void activatePendingPlaylist();
+void restartPlaylist(int entryIndex);
+void showPlaylist();
+int getPlaylistEntryIndex();
+size_t serializePlaylistChunk(PlaylistCursor &cursor, uint8_t *buffer, size_t maxLen);
+
+#endif // PLAYLIST_H
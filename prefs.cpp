@@ -1,3 +0,0 @@
-#include "prefs.h"
-
-Preferences prefs;
\ No newline at end of file
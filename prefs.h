@@ -1,10 +0,0 @@
-// prefs.h
-
-#ifndef PREFS_H
-#define PREFS_H
-
-#include <Preferences.h>
-
-extern Preferences prefs;
-
-#endif // PREFS_H
\ No newline at end of file
@@ -0,0 +1,356 @@
+#include "serialConsole.h"
+#include "FlapFunctions.h"
+#include "displaySettings.h"
+#include "letters.h"
+#include "crc.h"
+#include "env.h"
+
+/**
+ * @purpose Where the parser is in the byte stream. A frame starts with SERIAL_FRAME_MAGIC at the beginning of a line.
+ */
+enum ConsoleState {
+  CONSOLE_LINE,
+  CONSOLE_FRAME_HEADER,
+  CONSOLE_FRAME_PAYLOAD,
+  CONSOLE_FRAME_CRC,
+  CONSOLE_RESYNC, // After a frame error: bytes are discarded until the next SERIAL_FRAME_MAGIC or a quiet gap
+};
+
+ConsoleState consoleState = CONSOLE_LINE;
+char consoleLine[SERIAL_LINE_SIZE];
+size_t consoleLineLength = 0;
+bool consoleLineOverflow = false;
+
+uint8_t frameHeader[SERIAL_FRAME_HEADER_SIZE];
+uint8_t framePayload[SERIAL_FRAME_MAX_PAYLOAD];
+size_t frameBytesRead = 0;
+size_t framePayloadLength = 0;
+unsigned long lastConsoleByteMillis = 0;
+
+/**
+ * @caller The console command handlers
+ * @purpose Parse a whole argument as a decimal integer
+ */
+bool parseConsoleInt(const char *text, int &value)
+{
+  char *end;
+  long parsed = strtol(text, &end, 10);
+  if (end == text || (*end != '\0' && *end != ' '))
+  {
+    return false;
+  }
+  value = (int)parsed;
+  return true;
+}
+
+/**
+ * @caller runConsoleLine()
+ * @purpose Handlers of the console commands. Each gets the text after the command name and returns false if it is not valid, in which case the whole line is shown as a text.
+ */
+bool handleModeCommand(const char *args, LoopCommandHandler applyCommand, bool &renderNeeded)
+{
+  if (strcmp(args, "playlist") == 0)
+  {
+    renderNeeded |= applyCommand(makeIntCommand(LOOP_COMMAND_START_PLAYLIST, 0));
+    return true;
+  }
+  const char *modes[] = {"text", "date", "clock", "zones", "feed", "stream"};
+  for (const char *mode : modes)
+  {
+    if (strcmp(args, mode) == 0)
+    {
+      renderNeeded |= applyCommand(makeTextCommand(LOOP_COMMAND_SET_MODE, mode));
+      return true;
+    }
+  }
+  return false;
+}
+
+bool handleAlignmentCommand(const char *args, LoopCommandHandler applyCommand, bool &renderNeeded)
+{
+  if (strcmp(args, "left") != 0 && strcmp(args, "right") != 0 && strcmp(args, "center") != 0)
+  {
+    return false;
+  }
+  renderNeeded |= applyCommand(makeTextCommand(LOOP_COMMAND_SET_ALIGNMENT, args));
+  return true;
+}
+
+bool handleRpmCommand(const char *args, LoopCommandHandler applyCommand, bool &renderNeeded)
+{
+  int rpm;
+  if (!parseConsoleInt(args, rpm) || rpm < 1 || rpm > 12)
+  {
+    return false;
+  }
+  renderNeeded |= applyCommand(makeIntCommand(LOOP_COMMAND_SET_RPM, rpm));
+  return true;
+}
+
+// offset <unit> <offset>: keep the magnetic zero position of the unit
+bool handleOffsetCommand(const char *args, LoopCommandHandler applyCommand, bool &renderNeeded)
+{
+  int unitAddr;
+  int offset;
+  const char *offsetArg = strchr(args, ' ');
+  if (!parseConsoleInt(args, unitAddr) || offsetArg == NULL || !parseConsoleInt(offsetArg + 1, offset))
+  {
+    return false;
+  }
+  if (unitAddr < 0 || unitAddr >= MAX_NUM_UNITS || offset == -1)
+  {
+    return false;
+  }
+  UnitState *unitStates = getFetchedStates();
+  renderNeeded |= applyCommand(makeCalibrationCommand(unitAddr, offset, unitStates[unitAddr].magneticZeroPositionLetterIndex));
+  return true;
+}
+
+// magnet <unit> [letter]: the letter defaults to a space
+bool handleMagnetCommand(const char *args, LoopCommandHandler applyCommand, bool &renderNeeded)
+{
+  int unitAddr;
+  if (!parseConsoleInt(args, unitAddr) || unitAddr < 0 || unitAddr >= MAX_NUM_UNITS)
+  {
+    return false;
+  }
+  const char *letterArg = strchr(args, ' ');
+  char magneticZeroPositionLetter = letterArg == NULL || letterArg[1] == '\0' ? ' ' : letterArg[1];
+  int magneticZeroPositionLetterIndex = translateLetterToIndex(magneticZeroPositionLetter);
+  Serial.printf("magnet: %c, %d\n", magneticZeroPositionLetter, magneticZeroPositionLetterIndex);
+  if (magneticZeroPositionLetterIndex == -1)
+  {
+    return false;
+  }
+  int suggestedOffset = getSuggestedOffset(magneticZeroPositionLetterIndex);
+  renderNeeded |= applyCommand(makeCalibrationCommand(unitAddr, suggestedOffset, magneticZeroPositionLetterIndex));
+  return true;
+}
+
+bool handleBenchmarkCommand(const char *args, LoopCommandHandler applyCommand, bool &renderNeeded)
+{
+  if (args[0] != '\0')
+  {
+    return false;
+  }
+  renderNeeded |= applyCommand(makeIntCommand(LOOP_COMMAND_RUN_I2C_BENCHMARK, 0));
+  return true;
+}
+
+// clock HH:MM: set the offline clock
+bool handleClockCommand(const char *args, LoopCommandHandler applyCommand, bool &renderNeeded)
+{
+  char clock[6];
+  strncpy(clock, args, sizeof(clock) - 1);
+  clock[sizeof(clock) - 1] = '\0';
+  setOfflineClock(clock);
+  renderNeeded = true;
+  return true;
+}
+
+struct ConsoleCommand {
+  const char *name;
+  bool (*handle)(const char *args, LoopCommandHandler applyCommand, bool &renderNeeded);
+};
+
+const ConsoleCommand consoleCommands[] = {
+    {"mode", handleModeCommand},
+    {"alignment", handleAlignmentCommand},
+    {"rpm", handleRpmCommand},
+    {"offset", handleOffsetCommand},
+    {"magnet", handleMagnetCommand},
+    {"benchmark", handleBenchmarkCommand},
+    {"clock", handleClockCommand},
+};
+
+/**
+ * @caller pollSerialConsole()
+ * @purpose Run a complete console line. A line that is not a valid command is shown as a text.
+ * @return true if the display has to be rendered again
+ */
+bool runConsoleLine(char *line, LoopCommandHandler applyCommand)
+{
+  // Trim leading and trailing whitespaces
+  while (*line == ' ' || *line == '\t')
+  {
+    line++;
+  }
+  size_t length = strlen(line);
+  while (length > 0 && (line[length - 1] == ' ' || line[length - 1] == '\t' || line[length - 1] == '\r'))
+  {
+    line[--length] = '\0';
+  }
+  if (length == 0)
+  {
+    return false;
+  }
+  Serial.printf("Received: %s\n", line);
+
+  size_t nameLength = strcspn(line, " ");
+  const char *args = line[nameLength] == '\0' ? line + nameLength : line + nameLength + 1;
+  bool renderNeeded = false;
+  for (const ConsoleCommand &command : consoleCommands)
+  {
+    if (strlen(command.name) == nameLength && strncmp(line, command.name, nameLength) == 0 && command.handle(args, applyCommand, renderNeeded))
+    {
+      return renderNeeded;
+    }
+  }
+  return applyCommand(makeTextCommand(LOOP_COMMAND_SET_TEXT, line));
+}
+
+/**
+ * @caller runConsoleFrame()
+ * @purpose Answer a frame, so that the host can pace itself on the acknowledgements
+ */
+void sendFrameAck(uint8_t type, uint8_t status)
+{
+  uint8_t ack[SERIAL_FRAME_HEADER_SIZE + 2] = {SERIAL_FRAME_MAGIC, (uint8_t)(SERIAL_FRAME_ACK | type), 1, 0, status, 0};
+  ack[sizeof(ack) - 1] = crc8(ack + 1, sizeof(ack) - 2);
+  Serial.write(ack, sizeof(ack));
+}
+
+/**
+ * @caller pollSerialConsole()
+ * @purpose Put a checked frame into the display frame and dispatch it right away. The display switches to stream mode, so that no other mode overwrites it.
+ * @return true if the frame was valid
+ */
+bool runConsoleFrame(uint8_t type, const uint8_t *payload, size_t length, LoopCommandHandler applyCommand)
+{
+  int globalRpm = getDisplaySettings().rpm;
+  if (type == SERIAL_FRAME_LETTERS && length >= 1 && length - 1 <= MAX_NUM_UNITS)
+  {
+    int flapRpm = payload[0] == 0 ? globalRpm : payload[0];
+    for (size_t i = 1; i < length; i++)
+    {
+      // Letter indices out of range, e.g. PLAYLIST_FRAME_KEEP, leave the unit as is
+      setFrameUnit(i - 1, payload[i], flapRpm);
+    }
+  }
+  else if (type == SERIAL_FRAME_UNITS && length % 4 == 0)
+  {
+    for (size_t i = 0; i < length; i += 4)
+    {
+      int unitAddr = payload[i] | (payload[i + 1] << 8);
+      setFrameUnit(unitAddr, payload[i + 2], payload[i + 3] == 0 ? globalRpm : payload[i + 3]);
+    }
+  }
+  else
+  {
+    return false;
+  }
+
+  if (strcmp(getDisplaySettings().mode, "stream") != 0)
+  {
+    applyCommand(makeTextCommand(LOOP_COMMAND_SET_MODE, "stream"));
+  }
+  dispatchFrame();
+  return true;
+}
+
+/**
+ * @caller loop() in ESP.ino, on every iteration
+ * @purpose Consume whatever the serial port has received without waiting for more, and run each console line or binary frame as soon as it is complete.
+ * @return true if the display has to be rendered again
+ */
+bool pollSerialConsole(LoopCommandHandler applyCommand)
+{
+  bool renderNeeded = false;
+  while (Serial.available() > 0)
+  {
+    uint8_t c = Serial.read();
+    lastConsoleByteMillis = millis();
+    switch (consoleState)
+    {
+    case CONSOLE_RESYNC:
+      if (c != SERIAL_FRAME_MAGIC)
+      {
+        break;
+      }
+      consoleState = CONSOLE_FRAME_HEADER;
+      frameHeader[0] = c;
+      frameBytesRead = 1;
+      break;
+    case CONSOLE_LINE:
+      if (c == SERIAL_FRAME_MAGIC && consoleLineLength == 0)
+      {
+        consoleState = CONSOLE_FRAME_HEADER;
+        frameHeader[0] = c;
+        frameBytesRead = 1;
+      }
+      else if (c == '\n')
+      {
+        consoleLine[consoleLineLength] = '\0';
+        if (consoleLineOverflow)
+        {
+          Serial.println("Console line too long, ignored");
+        }
+        else
+        {
+          renderNeeded |= runConsoleLine(consoleLine, applyCommand);
+        }
+        consoleLineLength = 0;
+        consoleLineOverflow = false;
+      }
+      else if (consoleLineLength < sizeof(consoleLine) - 1)
+      {
+        consoleLine[consoleLineLength++] = c;
+      }
+      else
+      {
+        consoleLineOverflow = true;
+      }
+      break;
+    case CONSOLE_FRAME_HEADER:
+      frameHeader[frameBytesRead++] = c;
+      if (frameBytesRead == SERIAL_FRAME_HEADER_SIZE)
+      {
+        framePayloadLength = frameHeader[2] | (frameHeader[3] << 8);
+        if (framePayloadLength > SERIAL_FRAME_MAX_PAYLOAD)
+        {
+          // The payload that follows is not read, so it must not be taken for console lines
+          sendFrameAck(frameHeader[1], SERIAL_FRAME_STATUS_BAD_FRAME);
+          consoleState = CONSOLE_RESYNC;
+          break;
+        }
+        frameBytesRead = 0;
+        consoleState = framePayloadLength == 0 ? CONSOLE_FRAME_CRC : CONSOLE_FRAME_PAYLOAD;
+      }
+      break;
+    case CONSOLE_FRAME_PAYLOAD:
+      framePayload[frameBytesRead++] = c;
+      if (frameBytesRead == framePayloadLength)
+      {
+        consoleState = CONSOLE_FRAME_CRC;
+      }
+      break;
+    case CONSOLE_FRAME_CRC:
+    {
+      // The checksum covers everything but the magic
+      uint8_t crc = crc8(frameHeader + 1, SERIAL_FRAME_HEADER_SIZE - 1);
+      crc = crc8(framePayload, framePayloadLength, crc);
+      uint8_t status = SERIAL_FRAME_STATUS_BAD_CRC;
+      if (crc == c)
+      {
+        status = runConsoleFrame(frameHeader[1], framePayload, framePayloadLength, applyCommand) ? SERIAL_FRAME_STATUS_OK : SERIAL_FRAME_STATUS_BAD_FRAME;
+      }
+      sendFrameAck(frameHeader[1], status);
+      // A corrupted length may have ended the frame too early, so a rejected frame is followed by a resync
+      consoleState = status == SERIAL_FRAME_STATUS_OK ? CONSOLE_LINE : CONSOLE_RESYNC;
+      break;
+    }
+    }
+  }
+
+  // Checked only once the received bytes are consumed, so that a frame delayed by a slow loop() is not dropped
+  if (consoleState != CONSOLE_LINE && millis() - lastConsoleByteMillis >= SERIAL_FRAME_TIMEOUT_MILLIS)
+  {
+    if (consoleState != CONSOLE_RESYNC)
+    {
+      Serial.println("Serial frame timed out");
+    }
+    // The host has stopped sending for long enough that the next byte starts a line or a frame
+    consoleState = CONSOLE_LINE;
+  }
+  return renderNeeded;
+}
@@ -0,0 +1,14 @@
+#ifndef SERIALCONSOLE_H
+#define SERIALCONSOLE_H
+
+#include <Arduino.h>
+#include "commandQueue.h"
+
+/**
+ * @purpose Applies a command on the loop task and tells whether the display has to be rendered again
+ */
+typedef bool (*LoopCommandHandler)(const LoopCommand &command);
+
+bool pollSerialConsole(LoopCommandHandler applyCommand);
+
+#endif // SERIALCONSOLE_H
@@ -1,85 +1,18 @@
 #include "stringHandling.h"
 #include "env.h"
-#include "nvsUtils.h"
 
-// converts input string to uppercase
-String cleanString(String message)
+// gets the position of the first character of a message aligned within a width of units.
+// negative if the message is longer than the width, in which case its leading characters are cut off.
+// left: the message is cut off on the right side, right: on the left side, center: on both sides
+int getAlignedStart(int length, int width, const char *alignment)
 {
-  message.toUpperCase();
-  return message;
-}
-
-// aligns string center by filling the left and right with spaces up the max of the units amount
-String centerString(String message)
-{
-  // Takes care of the left side of the text (if any)
-  int numUnits = getNvsInt(PARAM_NUM_UNITS, 1);
-  if (message.length() > numUnits)
-  {
-    int start = (message.length() - numUnits) / 2;
-    message = message.substring(start, start + numUnits);
-  }
-  else
-  {
-    int leftSpaceAmount = (numUnits - (int)message.length()) / 2;
-    for (int i = 0; i < leftSpaceAmount; i++)
-    {
-      message = " " + message;
-    }
-
-    // Take care of the right side of the text (if any)
-    for (int i = message.length(); i < numUnits; i++)
-    {
-      message = message + " ";
-    }
-  }
-
-  message = cleanString(message);
-
-  return message;
-}
-
-// aligns string on right side of array and fills empty chars with spaces
-String rightString(String message)
-{
-  int numUnits = getNvsInt(PARAM_NUM_UNITS, 1);
-  if (message.length() > numUnits)
-  {
-    int start = message.length() - numUnits;
-    message = message.substring(start);
-  }
-  else
-  {
-    int rightSpaceAmount = (numUnits - message.length());
-    for (int i = 0; i < rightSpaceAmount; i++)
-    {
-      message = " " + message;
-    }
-  }
-
-  message = cleanString(message);
-
-  return message;
-}
-
-// aligns string on left side of array and fills empty chars with spaces
-String leftString(String message)
-{
-  int numUnits = getNvsInt(PARAM_NUM_UNITS, 1);
-  if (message.length() > numUnits)
+  if (strcmp(alignment, "right") == 0)
   {
-    message = message.substring(0, numUnits);
+    return width - length;
   }
-  else
+  if (strcmp(alignment, "center") == 0)
   {
-    int leftSpaceAmount = (numUnits - message.length());
-    for (int i = 0; i < leftSpaceAmount; i++)
-    {
-      message = message + " ";
-    }
+    return (width - length) / 2;
   }
-
-  message = cleanString(message);
-
-  return message;
+  return 0;
 }
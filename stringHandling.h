@@ -3,7 +3,6 @@
 
 #include <Arduino.h>
 
-String centerString(String message);
-String rightString(String message);
+int getAlignedStart(int length, int width, const char *alignment);
 
-#endif // STRINGHANDLING_H
\ No newline at end of file
+#endif // STRINGHANDLING_H
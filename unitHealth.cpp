@@ -0,0 +1,143 @@
+#include "unitHealth.h"
+#include "env.h"
+
+/**
+ * @purpose Maintain the health of every unit as a global variable. Zero-initialized, i.e. every unit starts online.
+ */
+UnitHealth unitHealths[MAX_NUM_UNITS];
+
+/**
+ * @caller recordTransaction() in FlapFunctions.cpp
+ * @purpose Mark a unit as online after a successful transaction
+ * @return true if the unit was offline before, i.e. it has just come back
+ */
+bool recordUnitSuccess(int unitAddr)
+{
+  if (unitAddr < 0 || unitAddr >= MAX_NUM_UNITS)
+  {
+    return false;
+  }
+  UnitHealth &health = unitHealths[unitAddr];
+  bool wasOffline = health.state == UNIT_HEALTH_OFFLINE;
+  if (wasOffline)
+  {
+    Serial.printf("Unit %d is back online\n", unitAddr);
+  }
+  health.state = UNIT_HEALTH_ONLINE;
+  health.consecutiveFailures = 0;
+  health.probeBackoffMillis = 0;
+  return wasOffline;
+}
+
+/**
+ * @caller recordTransaction() in FlapFunctions.cpp
+ * @purpose Degrade a unit after a failed transaction. Take it offline after repeated failures or a long silence, and schedule the next probe with an exponential backoff.
+ */
+void recordUnitFailure(int unitAddr, unsigned long lastResponseAtMillis)
+{
+  if (unitAddr < 0 || unitAddr >= MAX_NUM_UNITS)
+  {
+    return;
+  }
+  UnitHealth &health = unitHealths[unitAddr];
+  unsigned long currentMillis = millis();
+  health.consecutiveFailures++;
+  health.numFailures++;
+
+  bool silentTooLong = currentMillis - lastResponseAtMillis >= UNIT_OFFLINE_SILENCE_MILLIS;
+  if (health.state == UNIT_HEALTH_OFFLINE)
+  {
+    // A failed probe. Wait longer before the next one.
+    health.probeBackoffMillis = min(health.probeBackoffMillis * 2, (unsigned long)UNIT_PROBE_BACKOFF_MAX_MILLIS);
+  }
+  else if (health.consecutiveFailures >= UNIT_OFFLINE_AFTER_FAILURES || (health.state == UNIT_HEALTH_DEGRADED && silentTooLong))
+  {
+    Serial.printf("Unit %d is offline after %d consecutive failures\n", unitAddr, health.consecutiveFailures);
+    health.state = UNIT_HEALTH_OFFLINE;
+    health.probeBackoffMillis = UNIT_PROBE_BACKOFF_MIN_MILLIS;
+  }
+  else
+  {
+    health.state = UNIT_HEALTH_DEGRADED;
+  }
+  health.nextProbeAtMillis = currentMillis + health.probeBackoffMillis;
+}
+
+/**
+ * @caller writeToUnit(), applyPendingUpdates() and recordTransaction() in FlapFunctions.cpp, runI2CBenchmark() in I2C.cpp
+ * @purpose Tell whether a unit is taken out of the hot path
+ */
+bool isUnitOffline(int unitAddr)
+{
+  if (unitAddr < 0 || unitAddr >= MAX_NUM_UNITS)
+  {
+    return true;
+  }
+  return unitHealths[unitAddr].state == UNIT_HEALTH_OFFLINE;
+}
+
+/**
+ * @caller fetchAndSetUnitStates() in FlapFunctions.cpp
+ * @purpose Tell whether a unit should be polled in this tick. Offline units are polled only when their probe is due.
+ */
+bool shouldPollUnit(int unitAddr)
+{
+  if (!isUnitOffline(unitAddr))
+  {
+    return true;
+  }
+  if (unitAddr < 0 || unitAddr >= MAX_NUM_UNITS)
+  {
+    return false;
+  }
+  // Signed difference keeps the comparison correct across the millis() wrap-around
+  return (long)(millis() - unitHealths[unitAddr].nextProbeAtMillis) >= 0;
+}
+
+/**
+ * @caller updatePendingUpdatesSerialized() in FlapFunctions.cpp
+ * @purpose Get a copy of the health of a unit
+ */
+UnitHealth getUnitHealth(int unitAddr)
+{
+  if (unitAddr < 0 || unitAddr >= MAX_NUM_UNITS)
+  {
+    return UnitHealth{UNIT_HEALTH_OFFLINE, 0, 0, 0, 0};
+  }
+  return unitHealths[unitAddr];
+}
+
+/**
+ * @caller updatePendingUpdatesSerialized() in FlapFunctions.cpp
+ * @purpose Translate a health state to its name for the web API and logging
+ */
+const char *getUnitHealthName(int state)
+{
+  switch (state)
+  {
+  case UNIT_HEALTH_ONLINE:
+    return "online";
+  case UNIT_HEALTH_DEGRADED:
+    return "degraded";
+  case UNIT_HEALTH_OFFLINE:
+    return "offline";
+  }
+  return "unknown";
+}
+
+/**
+ * @caller GET /misc handler in ESP.ino
+ * @purpose Count the units currently taken out of the hot path
+ */
+int getNumOfflineUnits(int numUnits)
+{
+  int numOfflineUnits = 0;
+  for (int i = 0; i < numUnits && i < MAX_NUM_UNITS; i++)
+  {
+    if (unitHealths[i].state == UNIT_HEALTH_OFFLINE)
+    {
+      numOfflineUnits++;
+    }
+  }
+  return numOfflineUnits;
+}
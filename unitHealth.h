@@ -0,0 +1,22 @@
+#ifndef UNITHEALTH_H
+#define UNITHEALTH_H
+
+#include <Arduino.h>
+
+struct UnitHealth {
+    int state;                         // UNIT_HEALTH_ONLINE, UNIT_HEALTH_DEGRADED or UNIT_HEALTH_OFFLINE
+    int consecutiveFailures;           // Failed transactions since the last successful one
+    unsigned long numFailures;         // Failed transactions since boot
+    unsigned long nextProbeAtMillis;   // millis() at which an offline unit is polled again
+    unsigned long probeBackoffMillis;  // Current wait between two probes of an offline unit
+};
+
+bool recordUnitSuccess(int unitAddr);
+void recordUnitFailure(int unitAddr, unsigned long lastResponseAtMillis);
+bool isUnitOffline(int unitAddr);
+bool shouldPollUnit(int unitAddr);
+UnitHealth getUnitHealth(int unitAddr);
+const char *getUnitHealthName(int state);
+int getNumOfflineUnits(int numUnits);
+
+#endif // UNITHEALTH_H
@@ -0,0 +1,198 @@
+#include <Wire.h>
+#include "unitProtocol.h"
+#include "env.h"
+#include "crc.h"
+#include "I2C.h"
+#include "i2cTrace.h"
+#include "nvsUtils.h"
+
+/**
+ * @purpose Maintain the protocol of every unit as a global variable. Zero-initialized, i.e. every unit starts unknown.
+ */
+UnitProtocol unitProtocols[MAX_NUM_UNITS];
+
+/**
+ * @purpose Whether units are greeted with the v2 handshake. Off by default, since the hello has not been confirmed harmless to every legacy firmware. loop() only.
+ */
+bool unitProtocolV2Enabled = false;
+
+/**
+ * @caller setup() in ESP.ino
+ */
+void loadUnitProtocolSetting()
+{
+  unitProtocolV2Enabled = getNvsInt(PARAM_UNIT_PROTOCOL_V2, 0) != 0;
+}
+
+/**
+ * @caller applyLoopCommand() in ESP.ino
+ * @purpose Store the setting. Turning v2 off forgets every negotiated protocol, so that all units are written the legacy way again.
+ */
+void setUnitProtocolV2Enabled(bool enabled)
+{
+  putNvsInt(PARAM_UNIT_PROTOCOL_V2, enabled ? 1 : 0);
+  unitProtocolV2Enabled = enabled;
+  if (!enabled)
+  {
+    for (int i = 0; i < MAX_NUM_UNITS; i++)
+    {
+      resetUnitProtocol(i);
+    }
+  }
+}
+
+/**
+ * @caller fetchAndSetUnitStates() in FlapFunctions.cpp, once the segment of the unit is selected
+ * @purpose Ask a unit of unknown protocol for its version and capabilities. A legacy unit ignores the hello and answers its state, whose first byte is never the magic.
+ * The protocol stays unknown if the unit does not answer or its answer is corrupted, so that the handshake is retried on the next tick.
+ * Units stay unknown, and are written the legacy way, unless the v2 setting is on.
+ */
+void negotiateUnitProtocol(int unitAddr)
+{
+  if (!unitProtocolV2Enabled || unitAddr < 0 || unitAddr >= MAX_NUM_UNITS || unitProtocols[unitAddr].version != UNIT_PROTOCOL_UNKNOWN)
+  {
+    return;
+  }
+  int busAddress = getUnitBusAddress(unitAddr);
+  uint8_t hello[] = {COMMAND_HELLO, PROTOCOL_V2_MAGIC, 0};
+  hello[2] = crc8(hello, 2);
+
+  uint32_t traceStartMicros = beginI2CTrace();
+  Wire.beginTransmission(busAddress);
+  Wire.write(hello, sizeof(hello));
+  int retEndTransmission = Wire.endTransmission();
+  if (retEndTransmission != 0)
+  {
+    traceI2C(traceStartMicros, I2C_TRACE_KIND_HELLO, unitAddr, busAddress, COMMAND_HELLO, NULL, 0, retEndTransmission);
+    return;
+  }
+  delayMicroseconds(PROTOCOL_V2_TURNAROUND_MICROS);
+  int bytesRead = Wire.requestFrom(busAddress, HELLO_ANSWER_SIZE, true);
+  if (bytesRead != HELLO_ANSWER_SIZE)
+  {
+    traceI2C(traceStartMicros, I2C_TRACE_KIND_HELLO, unitAddr, busAddress, COMMAND_HELLO, NULL, 0, I2C_TRACE_RESULT_SHORT_READ);
+    return;
+  }
+  uint8_t answer[HELLO_ANSWER_SIZE];
+  for (int i = 0; i < HELLO_ANSWER_SIZE; i++)
+  {
+    answer[i] = Wire.read();
+  }
+
+  UnitProtocol &protocol = unitProtocols[unitAddr];
+  int result = 0;
+  if (answer[0] != PROTOCOL_V2_MAGIC)
+  {
+    protocol.version = UNIT_PROTOCOL_LEGACY;
+    protocol.capabilities = 0;
+  }
+  else if (crc8(answer, HELLO_ANSWER_SIZE - 1) != answer[HELLO_ANSWER_SIZE - 1])
+  {
+    result = I2C_TRACE_RESULT_BAD_CRC;
+  }
+  else
+  {
+    // Later versions are expected to keep v2 working
+    protocol.version = UNIT_PROTOCOL_V2;
+    protocol.capabilities = answer[2];
+  }
+  traceI2C(traceStartMicros, I2C_TRACE_KIND_HELLO, unitAddr, busAddress, COMMAND_HELLO, answer, HELLO_ANSWER_SIZE, result);
+  if (result == 0)
+  {
+    Serial.printf("Unit %d speaks protocol %d, capabilities: 0x%02X\n", unitAddr, protocol.version, protocol.capabilities);
+  }
+}
+
+/**
+ * @caller recordTransaction() in FlapFunctions.cpp
+ * @purpose Forget the protocol of a unit that went offline, since its firmware may be replaced before it comes back
+ */
+void resetUnitProtocol(int unitAddr)
+{
+  if (unitAddr < 0 || unitAddr >= MAX_NUM_UNITS)
+  {
+    return;
+  }
+  unitProtocols[unitAddr].version = UNIT_PROTOCOL_UNKNOWN;
+  unitProtocols[unitAddr].capabilities = 0;
+}
+
+UnitProtocol getUnitProtocol(int unitAddr)
+{
+  if (unitAddr < 0 || unitAddr >= MAX_NUM_UNITS)
+  {
+    return UnitProtocol{UNIT_PROTOCOL_UNKNOWN, 0, 0};
+  }
+  return unitProtocols[unitAddr];
+}
+
+/**
+ * @caller fetchUnitState() in FlapFunctions.cpp and sendUnitCommandV2()
+ * @return true if an answer of ANSWER_V2_SIZE bytes passes its CRC-8
+ */
+bool isV2Answer(const uint8_t *answer)
+{
+  return crc8(answer, ANSWER_V2_SIZE - 1) == answer[ANSWER_V2_SIZE - 1];
+}
+
+/**
+ * @caller writeToUnit() and applyPendingUpdates() in FlapFunctions.cpp, once the segment of the unit is selected
+ * @purpose Send a v2 command and check that the unit acknowledged it. A command whose frame or acknowledgement was corrupted is sent again
+ * with the same sequence number, which the unit applies only once. A unit that does not answer to its address is not retried.
+ * @return true if the unit acknowledged the command, or accepted it if it does not acknowledge commands
+ */
+bool sendUnitCommandV2(int unitAddr, int command, const uint8_t *payload, int length, int traceKind)
+{
+  int busAddress = getUnitBusAddress(unitAddr);
+  UnitProtocol &protocol = unitProtocols[unitAddr];
+  length = min(length, PROTOCOL_V2_MAX_COMMAND_SIZE - 3);
+  uint8_t frame[PROTOCOL_V2_MAX_COMMAND_SIZE];
+  frame[0] = command;
+  frame[1] = ++protocol.sequence;
+  memcpy(frame + 2, payload, length);
+  frame[2 + length] = crc8(frame, 2 + length);
+  bool isAcknowledged = protocol.capabilities & UNIT_CAPABILITY_ACKED_WRITES;
+
+  for (int attempt = 0; attempt <= PROTOCOL_V2_MAX_RETRIES; attempt++)
+  {
+    uint32_t traceStartMicros = beginI2CTrace();
+    Wire.beginTransmission(busAddress);
+    Wire.write(frame, length + 3);
+    int result = Wire.endTransmission();
+    if (result == 0 && isAcknowledged)
+    {
+      uint8_t answer[ANSWER_V2_SIZE];
+      // Give the unit time to apply the command and prepare its acknowledgement
+      delayMicroseconds(PROTOCOL_V2_TURNAROUND_MICROS);
+      int bytesRead = Wire.requestFrom(busAddress, ANSWER_V2_SIZE, true);
+      for (int i = 0; i < bytesRead && i < ANSWER_V2_SIZE; i++)
+      {
+        answer[i] = Wire.read();
+      }
+      if (bytesRead != ANSWER_V2_SIZE)
+      {
+        result = I2C_TRACE_RESULT_SHORT_READ;
+      }
+      else if (!isV2Answer(answer))
+      {
+        result = I2C_TRACE_RESULT_BAD_CRC;
+      }
+      else if (answer[4] != frame[1] || answer[5] != PROTOCOL_V2_STATUS_OK)
+      {
+        result = I2C_TRACE_RESULT_NOT_ACKNOWLEDGED;
+      }
+    }
+    traceI2C(traceStartMicros, traceKind, unitAddr, busAddress, command, payload, length, result);
+    if (result == 0)
+    {
+      return true;
+    }
+    // Address NACK: the unit is not there, so a retry would only slow the bus down
+    if (result == 2)
+    {
+      return false;
+    }
+    Serial.printf("Unit %d did not acknowledge command %d, result: %d\n", unitAddr, command, result);
+  }
+  return false;
+}
@@ -0,0 +1,20 @@
+#ifndef UNITPROTOCOL_H
+#define UNITPROTOCOL_H
+
+#include <Arduino.h>
+
+struct UnitProtocol {
+    uint8_t version;       // UNIT_PROTOCOL_*
+    uint8_t capabilities;  // UNIT_CAPABILITY_*, v2 only
+    uint8_t sequence;      // Sequence number of the last v2 command
+};
+
+void loadUnitProtocolSetting();
+void setUnitProtocolV2Enabled(bool enabled);
+void negotiateUnitProtocol(int unitAddr);
+void resetUnitProtocol(int unitAddr);
+UnitProtocol getUnitProtocol(int unitAddr);
+bool isV2Answer(const uint8_t *answer);
+bool sendUnitCommandV2(int unitAddr, int command, const uint8_t *payload, int length, int traceKind);
+
+#endif // UNITPROTOCOL_H
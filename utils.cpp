@@ -7,6 +7,17 @@ void debugF(const char* format, ...) {
     #endif
 }
 
+// Serial.printf() allocates on the heap for lines longer than 64 characters, so the log lines of loop() are formatted here instead.
+// loop() only, because of the shared buffer.
+void logF(const char* format, ...) {
+    static char line[LOG_LINE_SIZE];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    Serial.write((const uint8_t*)line, min(max(length, 0), (int)sizeof(line) - 1));
+}
+
 String getChipId() {
     uint64_t macAddress = ESP.getEfuseMac();
     uint32_t chipID = (uint32_t)(macAddress >> 24);
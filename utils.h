@@ -2,6 +2,7 @@
 #define UTILS_H
 
 void debugF(const char* format, ...);
+void logF(const char* format, ...);
 String getChipId();
 
 #endif // UTILS_H
\ No newline at end of file
@@ -189,7 +189,7 @@ export default function App() {
 						<Card title="Main Settings">
 							<div className='flex flex-col gap-4 items-start'>
 								<Form.Item name="numUnits" label="Number of Units">
-									<InputNumber min={0} max={128} />
+									<InputNumber min={0} max={512} />
 								</Form.Item>
 								<Form.Item name="mode" label="Device Mode">
 									<Radio.Group
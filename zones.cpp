@@ -0,0 +1,223 @@
+#include <Arduino_JSON.h>
+#include "zones.h"
+#include "FlapFunctions.h"
+#include "Timezone.h"
+#include "nvsUtils.h"
+#include "displaySettings.h"
+
+/**
+ * @purpose The zones of the "zones" mode, loaded from NVS. loop() only.
+ */
+Zone zones[MAX_NUM_ZONES];
+int numZones = 0;
+
+/**
+ * @purpose A validated zone list handed over from the POST /zones handler to loop(), which stores it in NVS
+ */
+char stagedZonesJson[ZONES_JSON_MAX_LENGTH + 1];
+bool zonesStaged = false;
+portMUX_TYPE stagedZonesLock = portMUX_INITIALIZER_UNLOCKED;
+
+/**
+ * @caller renderZones()
+ * @purpose FNV-1a hash of a zone's content and the settings it is composed with
+ */
+uint32_t hashZoneContent(const char *content, const char *alignment, int rpm)
+{
+  uint32_t hash = 2166136261u;
+  const char *parts[] = {content, "\n", alignment};
+  for (const char *part : parts)
+  {
+    for (const char *c = part; *c != '\0'; c++)
+    {
+      hash = (hash ^ (uint8_t)*c) * 16777619u;
+    }
+  }
+  hash = (hash ^ (uint32_t)rpm) * 16777619u;
+  return hash == 0 ? 1 : hash;
+}
+
+/**
+ * @caller POST /zones handler in ESP.ino
+ * @purpose Check a zone list and normalize it for storage
+ * @return The normalized JSON, or an empty string if the list is invalid
+ */
+String validateZones(String jsonString)
+{
+  JSONVar input = JSON.parse(jsonString);
+  if (JSON.typeof(input) != "array" || input.length() > MAX_NUM_ZONES)
+  {
+    return "";
+  }
+  JSONVar output = JSON.parse("[]");
+  for (int i = 0; i < input.length(); i++)
+  {
+    JSONVar zone = input[i];
+    if (JSON.typeof(zone["start"]) != "number" || JSON.typeof(zone["length"]) != "number" || JSON.typeof(zone["mode"]) != "string")
+    {
+      return "";
+    }
+    int start = (int)zone["start"];
+    int length = (int)zone["length"];
+    String mode = (const char *)zone["mode"];
+    String alignment = zone.hasOwnProperty("alignment") ? (const char *)zone["alignment"] : "left";
+    int rpm = zone.hasOwnProperty("rpm") ? (int)zone["rpm"] : 0;
+    String text = zone.hasOwnProperty("text") ? (const char *)zone["text"] : "";
+    bool validMode = mode == "text" || mode == "date" || mode == "clock" || mode == "scroll";
+    bool validAlignment = alignment == "left" || alignment == "center" || alignment == "right";
+    if (start < 0 || length < 1 || start + length > MAX_NUM_UNITS || !validMode || !validAlignment || rpm < 0 || rpm > 12 || text.length() > MAX_NUM_UNITS)
+    {
+      return "";
+    }
+    output[i]["start"] = start;
+    output[i]["length"] = length;
+    output[i]["mode"] = mode;
+    output[i]["alignment"] = alignment;
+    output[i]["rpm"] = rpm;
+    output[i]["text"] = text;
+  }
+  String normalized = JSON.stringify(output);
+  return normalized.length() <= ZONES_JSON_MAX_LENGTH ? normalized : "";
+}
+
+/**
+ * @caller POST /zones handler in ESP.ino
+ * @purpose Hand a validated zone list over to loop(). A list not yet stored is replaced.
+ */
+void stageZones(const String &zonesJson)
+{
+  portENTER_CRITICAL(&stagedZonesLock);
+  strncpy(stagedZonesJson, zonesJson.c_str(), ZONES_JSON_MAX_LENGTH);
+  stagedZonesJson[ZONES_JSON_MAX_LENGTH] = '\0';
+  zonesStaged = true;
+  portEXIT_CRITICAL(&stagedZonesLock);
+}
+
+/**
+ * @caller The zones command in ESP.ino
+ * @purpose Store the staged zone list in NVS and load it. Nothing is stored if an earlier command already did.
+ */
+void applyStagedZones()
+{
+  // Static to keep it off the loop task stack
+  static char zonesJson[ZONES_JSON_MAX_LENGTH + 1];
+  portENTER_CRITICAL(&stagedZonesLock);
+  bool staged = zonesStaged;
+  if (staged)
+  {
+    memcpy(zonesJson, stagedZonesJson, sizeof(zonesJson));
+    zonesStaged = false;
+  }
+  portEXIT_CRITICAL(&stagedZonesLock);
+  if (staged)
+  {
+    putNvsString(PARAM_ZONES, zonesJson);
+  }
+  loadZones();
+}
+
+/**
+ * @caller setup() and applyStagedZones()
+ * @purpose Load the zone list from NVS. It has been validated before being stored.
+ */
+void loadZones()
+{
+  JSONVar input = JSON.parse(getNvsString(PARAM_ZONES, "[]"));
+  numZones = 0;
+  for (int i = 0; i < input.length() && i < MAX_NUM_ZONES; i++)
+  {
+    JSONVar zone = input[i];
+    Zone &z = zones[numZones++];
+    z.start = (int)zone["start"];
+    z.length = (int)zone["length"];
+    strncpy(z.mode, (const char *)zone["mode"], sizeof(z.mode) - 1);
+    z.mode[sizeof(z.mode) - 1] = '\0';
+    strncpy(z.alignment, (const char *)zone["alignment"], sizeof(z.alignment) - 1);
+    z.alignment[sizeof(z.alignment) - 1] = '\0';
+    z.rpm = (int)zone["rpm"];
+    strncpy(z.text, (const char *)zone["text"], sizeof(z.text) - 1);
+    z.text[sizeof(z.text) - 1] = '\0';
+  }
+  Serial.printf("Loaded %d zones\n", numZones);
+  invalidateZones();
+}
+
+/**
+ * @caller loadZones() and renderDisplay() in ESP.ino
+ * @purpose Make every zone compose itself again, e.g. after another mode has overwritten the frame
+ */
+void invalidateZones()
+{
+  for (int i = 0; i < numZones; i++)
+  {
+    zones[i].contentHash = 0;
+  }
+}
+
+/**
+ * @caller renderZones()
+ * @purpose Get the window of a scrolling text. The text enters from the right, moving by one unit per tick.
+ * The window is always padded to the full width, so that the alignment of the zone does not move the tail of the text as it leaves.
+ */
+void getScrollWindow(char *buffer, const char *text, int width)
+{
+  // The text is scrolled as if preceded and followed by a blank zone
+  int length = strlen(text);
+  int position = (millis() / LOOP_TICK_MILLIS) % (width + length);
+  for (int i = 0; i < width; i++)
+  {
+    int paddedIndex = position + i;
+    buffer[i] = paddedIndex < width || paddedIndex >= width + length ? ' ' : text[paddedIndex - width];
+  }
+  buffer[width] = '\0';
+}
+
+/**
+ * @caller renderDisplay() in ESP.ino
+ * @purpose Compose the zones whose content has changed into the frame, then dispatch the frame once for all of them
+ */
+void renderZones(bool offline)
+{
+  // Static to keep it off the loop task stack
+  static char content[MAX_NUM_UNITS + 1];
+  int globalRpm = getDisplaySettings().rpm;
+  for (int i = 0; i < numZones; i++)
+  {
+    Zone &zone = zones[i];
+    const char *mode = zone.mode;
+    content[0] = '\0';
+    if (strcmp(mode, "text") == 0)
+    {
+      strcpy(content, zone.text);
+    }
+    else if (strcmp(mode, "date") == 0)
+    {
+      getDateString(content, sizeof(content));
+    }
+    else if (strcmp(mode, "clock") == 0)
+    {
+      if (offline)
+      {
+        getOfflineClockString(content, sizeof(content));
+      }
+      else
+      {
+        getClockString(content, sizeof(content));
+      }
+    }
+    else if (strcmp(mode, "scroll") == 0)
+    {
+      getScrollWindow(content, zone.text, zone.length);
+    }
+
+    int rpm = zone.rpm == 0 ? globalRpm : zone.rpm;
+    uint32_t contentHash = hashZoneContent(content, zone.alignment, rpm);
+    if (contentHash == zone.contentHash)
+    {
+      continue;
+    }
+    composeMessage(content, zone.alignment, rpm, zone.start, zone.length);
+    zone.contentHash = contentHash;
+  }
+  dispatchFrame();
+}
@@ -0,0 +1,27 @@
+#ifndef ZONES_H
+#define ZONES_H
+
+#include <Arduino.h>
+#include "env.h"
+
+/**
+ * @purpose A range of units with its own mode, alignment and RPM
+ */
+struct Zone {
+    int start;                           // First unit
+    int length;                          // Number of units
+    char mode[ZONE_MODE_SIZE];           // "text", "date", "clock" or "scroll"
+    char alignment[ZONE_ALIGNMENT_SIZE]; // "left", "center" or "right"
+    int rpm;                             // 0 means the global RPM
+    char text[MAX_NUM_UNITS + 1];        // Content of "text" and "scroll" modes
+    uint32_t contentHash;                // Hash of what was last composed into the frame. 0 forces a composition.
+};
+
+String validateZones(String jsonString);
+void stageZones(const String &zonesJson);
+void applyStagedZones();
+void loadZones();
+void invalidateZones();
+void renderZones(bool offline);
+
+#endif // ZONES_H